@@ -0,0 +1,213 @@
+#  Golden image regression test for the ray marcher and ray tracer
+#
+#  Renders every scene file next to each renderer and compares the
+#  result with a stored reference image in golden/. A render fails if
+#  any pixel is off by more than --max-error or the whole image falls
+#  below --min-psnr, so a change that is faster but wrong is caught.
+#  It also fails if the render is more than --slowdown percent slower
+#  than the reference time, so a change that is right but slower is
+#  caught too. Build the renderers first (see the top of rayMarcher.cpp
+#  and project3.cpp), then run:
+#
+#  python3 goldenImages.py --marcher "../Ray Marcher/rayMarcher" --tracer "../Ray Tracer/a"
+#
+#  Reference times only mean something on the machine they were taken
+#  on, so they live in golden/timings.json, which git ignores. Until
+#  --update has been run on this machine only the images are checked.
+#  Run it with --update again after a change that is meant to alter
+#  the images.
+
+
+import argparse
+import glob
+import json
+import math
+import os
+import struct
+import subprocess
+import tempfile
+import zlib
+
+repoFolder = os.path.dirname(os.path.dirname(os.path.abspath(__file__)))
+goldenFolder = os.path.join(os.path.dirname(os.path.abspath(__file__)), 'golden')
+timingsPath = os.path.join(goldenFolder, 'timings.json')
+noiseSeconds = 0.01
+
+def main():
+    parser = argparse.ArgumentParser(description='Compare renders against stored reference images and times.')
+    parser.add_argument('--marcher', help='path to the built ray marcher')
+    parser.add_argument('--tracer', help='path to the built ray tracer')
+    parser.add_argument('--threads', type=int, default=1, help='threads to render with')
+    parser.add_argument('--repeats', type=int, default=3, help='renders per scene, the fastest is timed')
+    parser.add_argument('--max-error', type=int, default=2, help='largest allowed difference in any pixel channel')
+    parser.add_argument('--min-psnr', type=float, default=40.0, help='smallest allowed PSNR in dB')
+    parser.add_argument('--slowdown', type=float, default=20.0, help='allowed render time increase in percent')
+    parser.add_argument('--update', action='store_true', help='store the renders as the new references')
+    args = parser.parse_args()
+
+    renderers = []
+    if args.marcher:
+        renderers.append(('marcher', args.marcher, os.path.join(repoFolder, 'Ray Marcher'), ['-q']))
+    if args.tracer:
+        renderers.append(('tracer', args.tracer, os.path.join(repoFolder, 'Ray Tracer'), []))
+    if not renderers:
+        raise SystemExit('Give --marcher, --tracer or both')
+
+    timings = {}
+    if os.path.exists(timingsPath):
+        with open(timingsPath) as file:
+            timings = json.load(file)
+
+    failures = 0
+    with tempfile.TemporaryDirectory() as workFolder:
+        for name, binary, sceneFolder, flags in renderers:
+            for scenePath in sorted(glob.glob(os.path.join(sceneFolder, 'scene*.txt'))):
+                sceneName = os.path.splitext(os.path.basename(scenePath))[0]
+                key = '%s/%s' % (name, sceneName)
+                referencePath = os.path.join(goldenFolder, name, sceneName + '.png')
+                renderPath = os.path.join(workFolder, '%s_%s.png' % (name, sceneName))
+                seconds = render(binary, scenePath, renderPath, args.threads, args.repeats, flags, workFolder)
+
+                if args.update:
+                    os.makedirs(os.path.dirname(referencePath), exist_ok=True)
+                    with open(renderPath, 'rb') as source, open(referencePath, 'wb') as target:
+                        target.write(source.read())
+                    timings[key] = seconds
+                    print('%-20s stored  %8.3fs' % (key, seconds))
+                    continue
+
+                if not os.path.exists(referencePath):
+                    print('%-20s FAIL    no reference image, run with --update' % key)
+                    failures += 1
+                    continue
+
+                maxError, psnr = compareImages(readPng(referencePath), readPng(renderPath))
+                problems = []
+                if maxError > args.max_error or psnr < args.min_psnr:
+                    problems.append('wrong')
+                # Tiny scenes render in milliseconds, so a slowdown also
+                # has to be bigger than the timer noise to count.
+                if (key in timings and seconds > timings[key] * (1.0 + args.slowdown / 100.0)
+                        and seconds - timings[key] > noiseSeconds):
+                    problems.append('slower')
+
+                change = ''
+                if key in timings:
+                    change = '%+6.1f%%' % ((seconds / timings[key] - 1.0) * 100.0)
+                print('%-20s %-7s %8.3fs %8s  max error %3d  PSNR %s' %
+                      (key, 'FAIL' if problems else 'ok', seconds, change, maxError,
+                       'identical' if psnr == math.inf else '%.1f dB' % psnr))
+                if problems:
+                    print('%-20s         %s' % ('', ' and '.join(problems)))
+                    failures += 1
+
+    if args.update:
+        with open(timingsPath, 'w') as file:
+            json.dump(timings, file, indent=2, sort_keys=True)
+            file.write('\n')
+        return 0
+
+    if not timings:
+        print('No reference times on this machine, run with --update to check speed too')
+    print('%d failed' % failures if failures else 'All renders match')
+    return 1 if failures else 0
+
+def render(binary, scenePath, imagePath, threads, repeats, flags, workFolder):
+    # Renders the scene repeats times and returns the fastest render time
+    # from the renderer's --stats report.
+    statsPath = os.path.join(workFolder, 'stats.json')
+    best = math.inf
+    for repeat in range(max(1, repeats)):
+        command = [binary, '-t', str(threads), '-s', scenePath, '-o', imagePath, '--stats', statsPath] + flags
+        completed = subprocess.run(command, stdout=subprocess.DEVNULL)
+        if completed.returncode != 0:
+            raise SystemExit('%s failed on %s' % (binary, scenePath))
+        with open(statsPath) as file:
+            best = min(best, json.load(file)['stages']['render'])
+    return best
+
+def compareImages(reference, image):
+    # Returns the largest difference in any channel and the PSNR over
+    # every channel. Images of different sizes can't match at all.
+    if reference[0] != image[0] or reference[1] != image[1]:
+        return 255, 0.0
+
+    referencePixels, pixels = reference[2], image[2]
+    maxError = 0
+    squaredError = 0
+    for index in range(len(pixels)):
+        difference = abs(referencePixels[index] - pixels[index])
+        if difference:
+            maxError = max(maxError, difference)
+            squaredError += difference * difference
+
+    if squaredError == 0:
+        return 0, math.inf
+    meanSquaredError = squaredError / len(pixels)
+    return maxError, 10.0 * math.log10(255.0 * 255.0 / meanSquaredError)
+
+def readPng(path):
+    # Reads the 8 bit RGB or RGBA PNGs the renderers write and returns
+    # (width, height, rgb bytes). Only the parts of the format CImg
+    # uses are handled.
+    with open(path, 'rb') as file:
+        data = file.read()
+    if data[:8] != b'\x89PNG\r\n\x1a\n':
+        raise SystemExit('%s is not a PNG file' % path)
+
+    position = 8
+    compressed = b''
+    while position < len(data):
+        length, chunkType = struct.unpack('>I4s', data[position:position + 8])
+        chunk = data[position + 8:position + 8 + length]
+        position += 12 + length
+        if chunkType == b'IHDR':
+            width, height, bitDepth, colorType, compression, filtering, interlace = struct.unpack('>IIBBBBB', chunk)
+            if bitDepth != 8 or colorType not in (2, 6) or interlace != 0:
+                raise SystemExit('%s uses a PNG layout this script can\'t read' % path)
+        elif chunkType == b'IDAT':
+            compressed += chunk
+        elif chunkType == b'IEND':
+            break
+
+    channels = 3 if colorType == 2 else 4
+    stride = width * channels
+    raw = zlib.decompress(compressed)
+    rows = bytearray()
+    previous = bytearray(stride)
+
+    for y in range(height):
+        filterType = raw[y * (stride + 1)]
+        row = bytearray(raw[y * (stride + 1) + 1:(y + 1) * (stride + 1)])
+        for x in range(stride if filterType else 0):
+            left = row[x - channels] if x >= channels else 0
+            up = previous[x]
+            upLeft = previous[x - channels] if x >= channels else 0
+            if filterType == 1:
+                row[x] = (row[x] + left) & 255
+            elif filterType == 2:
+                row[x] = (row[x] + up) & 255
+            elif filterType == 3:
+                row[x] = (row[x] + ((left + up) >> 1)) & 255
+            elif filterType == 4:
+                estimate = left + up - upLeft
+                distanceLeft, distanceUp, distanceUpLeft = abs(estimate - left), abs(estimate - up), abs(estimate - upLeft)
+                if distanceLeft <= distanceUp and distanceLeft <= distanceUpLeft:
+                    predictor = left
+                elif distanceUp <= distanceUpLeft:
+                    predictor = up
+                else:
+                    predictor = upLeft
+                row[x] = (row[x] + predictor) & 255
+        rows += row
+        previous = row
+
+    if channels == 4:
+        rgb = bytearray()
+        for index in range(0, len(rows), 4):
+            rgb += rows[index:index + 3]
+        rows = rgb
+    return width, height, bytes(rows)
+
+if __name__ == '__main__':
+    raise SystemExit(main())
@@ -0,0 +1,183 @@
+#  Scene scaling benchmark for the ray marcher and ray tracer
+#
+#  Generates scenes with sceneGenerator.py, renders each one with the
+#  renderers' batch mode, and records how the render time grows with
+#  the number of shapes and shrinks with the number of threads. The
+#  renderers have to be built first (see the top of rayMarcher.cpp and
+#  project3.cpp), then for example:
+#
+#  python3 scalingBenchmark.py --marcher "../Ray Marcher/rayMarcher" --tracer "../Ray Tracer/a"
+#
+#  The timings come from each renderer's --stats report. Results are
+#  written to the output folder as results.csv, along with the
+#  timeVsShapes.svg and timeVsThreads.svg plots.
+
+
+import argparse
+import csv
+import json
+import math
+import os
+import subprocess
+
+import sceneGenerator
+
+def main():
+    parser = argparse.ArgumentParser(description='Time both renderers against scene size and thread count.')
+    parser.add_argument('--marcher', help='path to the built ray marcher')
+    parser.add_argument('--tracer', help='path to the built ray tracer')
+    parser.add_argument('--counts', default='10,100,1000,10000,100000,1000000', help='shape counts to render')
+    parser.add_argument('--threads', default=None, help='thread counts to render with (1 up to every core)')
+    parser.add_argument('--thread-scene', type=int, default=10000, help='shape count for the thread scaling runs')
+    parser.add_argument('--distribution', choices=sceneGenerator.distributions, default='uniform')
+    parser.add_argument('--width', type=int, default=400)
+    parser.add_argument('--height', type=int, default=300)
+    parser.add_argument('--repeats', type=int, default=3, help='renders per point, the fastest is kept')
+    parser.add_argument('--output', default='scalingResults')
+    args = parser.parse_args()
+
+    renderers = []
+    if args.marcher:
+        renderers.append(('marcher', args.marcher, sceneGenerator.shapeTypes, ['-q']))
+    if args.tracer:
+        renderers.append(('tracer', args.tracer, ['sphere', 'triangle'], []))
+    if not renderers:
+        raise SystemExit('Give --marcher, --tracer or both')
+
+    counts = [int(value) for value in args.counts.split(',')]
+    if args.threads:
+        threadCounts = [int(value) for value in args.threads.split(',')]
+    else:
+        threadCounts = powersOfTwoUpTo(os.cpu_count() or 1)
+    os.makedirs(args.output, exist_ok=True)
+
+    # Points are kept by renderer, shapes and threads, so the thread
+    # scaling run that matches a shape scaling run isn't rendered twice.
+    results = {}
+    for name, binary, types, flags in renderers:
+        for count in counts:
+            key = (name, count, max(threadCounts))
+            results[key] = runPoint(args, name, binary, types, flags, count, max(threadCounts))
+        for threads in threadCounts:
+            key = (name, args.thread_scene, threads)
+            if key not in results:
+                results[key] = runPoint(args, name, binary, types, flags, args.thread_scene, threads)
+
+    writeResults(os.path.join(args.output, 'results.csv'), list(results.values()))
+
+    shapeSeries = {}
+    threadSeries = {}
+    for name, binary, types, flags in renderers:
+        shapeSeries[name] = [(count, results[(name, count, max(threadCounts))]['render']) for count in counts]
+        threadSeries[name] = [(threads, results[(name, args.thread_scene, threads)]['render']) for threads in threadCounts]
+
+    writePlot(os.path.join(args.output, 'timeVsShapes.svg'), shapeSeries,
+              'Render time vs shapes (%d threads)' % max(threadCounts), 'shapes', 'seconds', True)
+    writePlot(os.path.join(args.output, 'timeVsThreads.svg'), threadSeries,
+              'Render time vs threads (%d shapes)' % args.thread_scene, 'threads', 'seconds', True)
+    print('Wrote results to %s' % args.output)
+
+def powersOfTwoUpTo(limit):
+    # 1, 2, 4, ... and the limit itself.
+    values = []
+    value = 1
+    while value < limit:
+        values.append(value)
+        value *= 2
+    values.append(limit)
+    return values
+
+def runPoint(args, name, binary, types, flags, count, threads):
+    # Renders one scene with one thread count, args.repeats times, and
+    # returns the fastest run's stats.
+    scenePath = os.path.join(args.output, '%s_%s_%d.txt' % (name, args.distribution, count))
+    if not os.path.exists(scenePath):
+        sceneGenerator.writeScene(scenePath, count, args.distribution, types, 1, args.width, args.height)
+
+    imagePath = os.path.join(args.output, '%s_%d.png' % (name, count))
+    statsPath = os.path.join(args.output, 'stats.json')
+    best = None
+    for repeat in range(args.repeats):
+        command = [binary, '-t', str(threads), '-s', scenePath, '-o', imagePath, '--stats', statsPath] + flags
+        completed = subprocess.run(command, stdout=subprocess.DEVNULL)
+        if completed.returncode != 0:
+            raise SystemExit('%s failed on %s' % (binary, scenePath))
+        with open(statsPath) as file:
+            stats = json.load(file)
+        if best is None or stats['stages']['render'] < best['stages']['render']:
+            best = stats
+
+    result = {
+        'renderer': name,
+        'shapes': count,
+        'threads': threads,
+        'render': best['stages']['render'],
+        'build': best['stages']['build'],
+        'total': best['stages']['total'],
+        'raysPerSecond': best['raysPerSecond'],
+    }
+    print('%-8s %8d shapes %3d threads  %8.3fs render  %8.3fs build' %
+          (name, count, threads, result['render'], result['build']))
+    return result
+
+def writeResults(path, results):
+    with open(path, 'w', newline='') as file:
+        writer = csv.DictWriter(file, fieldnames=['renderer', 'shapes', 'threads', 'render', 'build', 'total', 'raysPerSecond'])
+        writer.writeheader()
+        writer.writerows(results)
+
+def writePlot(path, series, title, xLabel, yLabel, logScale):
+    # Draws one line per renderer as a small SVG, so no plotting
+    # library is needed. Both axes use a log scale when logScale is set.
+    width, height, margin = 640, 420, 60
+    points = [point for values in series.values() for point in values if point[1] > 0]
+    if not points:
+        return
+
+    def axis(values):
+        low, high = min(values), max(values)
+        if logScale:
+            low, high = math.log10(low), math.log10(high)
+        if high - low < 1e-9:
+            low, high = low - 0.5, high + 0.5
+        return low, high
+
+    xLow, xHigh = axis([point[0] for point in points])
+    yLow, yHigh = axis([point[1] for point in points])
+
+    def position(x, y):
+        if logScale:
+            x, y = math.log10(x), math.log10(y)
+        return (margin + (x - xLow) / (xHigh - xLow) * (width - 2 * margin),
+                height - margin - (y - yLow) / (yHigh - yLow) * (height - 2 * margin))
+
+    colors = ['#d62728', '#1f77b4', '#2ca02c', '#9467bd']
+    lines = ['<svg xmlns="http://www.w3.org/2000/svg" width="%d" height="%d" font-family="sans-serif" font-size="12">' % (width, height),
+             '<rect width="100%" height="100%" fill="white"/>',
+             '<text x="%d" y="24" text-anchor="middle" font-size="15">%s</text>' % (width // 2, title),
+             '<line x1="%d" y1="%d" x2="%d" y2="%d" stroke="black"/>' % (margin, height - margin, width - margin, height - margin),
+             '<line x1="%d" y1="%d" x2="%d" y2="%d" stroke="black"/>' % (margin, margin, margin, height - margin),
+             '<text x="%d" y="%d" text-anchor="middle">%s%s</text>' % (width // 2, height - 15, xLabel, ' (log)' if logScale else ''),
+             '<text x="15" y="%d" transform="rotate(-90 15 %d)" text-anchor="middle">%s%s</text>' %
+             (height // 2, height // 2, yLabel, ' (log)' if logScale else '')]
+
+    for x, y in sorted(set(points)):
+        px, py = position(x, y)
+        lines.append('<text x="%.1f" y="%d" text-anchor="middle" fill="gray">%g</text>' % (px, height - margin + 16, x))
+        lines.append('<text x="%d" y="%.1f" text-anchor="end" fill="gray">%.3g</text>' % (margin - 4, py + 4, y))
+
+    for index, (name, values) in enumerate(sorted(series.items())):
+        color = colors[index % len(colors)]
+        coordinates = ['%.1f,%.1f' % position(x, y) for x, y in sorted(values) if y > 0]
+        lines.append('<polyline fill="none" stroke="%s" stroke-width="2" points="%s"/>' % (color, ' '.join(coordinates)))
+        for coordinate in coordinates:
+            cx, cy = coordinate.split(',')
+            lines.append('<circle cx="%s" cy="%s" r="3" fill="%s"/>' % (cx, cy, color))
+        lines.append('<text x="%d" y="%d" fill="%s">%s</text>' % (width - margin - 60, margin + 16 * index, color, name))
+
+    lines.append('</svg>')
+    with open(path, 'w') as file:
+        file.write('\n'.join(lines) + '\n')
+
+if __name__ == '__main__':
+    main()
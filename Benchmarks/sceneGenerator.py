@@ -0,0 +1,126 @@
+#  Procedural scene generator for the ray marcher and ray tracer
+#
+#  Writes scene files in the same text format as the hand written
+#  scenes, with any number of shapes laid out in one of a few
+#  distributions. Run it directly to write one scene:
+#
+#  python3 sceneGenerator.py --count 10000 --distribution clustered --output scene10k.txt
+#
+#  The ray tracer only reads spheres and triangles, so pass
+#  --types sphere,triangle for scenes meant for it.
+
+
+import argparse
+import math
+import random
+
+shapeTypes = ['sphere', 'box', 'cylinder', 'triangle']
+distributions = ['uniform', 'clustered', 'grid']
+
+# Every scene fills a cube of this half width around the origin,
+# so the camera and image stay the same as the count grows.
+sceneExtent = 4.0
+
+def main():
+    parser = argparse.ArgumentParser(description='Write a procedural scene file.')
+    parser.add_argument('--count', type=int, default=1000, help='number of shapes (10 to 1000000)')
+    parser.add_argument('--distribution', choices=distributions, default='uniform')
+    parser.add_argument('--types', default=','.join(shapeTypes), help='comma separated shape types to use')
+    parser.add_argument('--seed', type=int, default=1)
+    parser.add_argument('--width', type=int, default=400)
+    parser.add_argument('--height', type=int, default=300)
+    parser.add_argument('--output', default='generatedScene.txt')
+    args = parser.parse_args()
+
+    types = parseTypes(args.types)
+    writeScene(args.output, args.count, args.distribution, types, args.seed, args.width, args.height)
+    print('Wrote %d shapes to %s' % (args.count, args.output))
+
+def parseTypes(text):
+    # Turns "sphere,box" into a list of shape types, rejecting any the renderers don't know.
+    types = [name.strip() for name in text.split(',') if name.strip()]
+    for name in types:
+        if name not in shapeTypes:
+            raise SystemExit('Unknown shape type %s, expected some of %s' % (name, ','.join(shapeTypes)))
+    if not types:
+        raise SystemExit('At least one shape type is needed')
+    return types
+
+def writeScene(path, count, distribution, types, seed, width, height):
+    # Writes the whole scene to path. The same arguments always give the same file.
+    with open(path, 'w') as file:
+        for line in sceneLines(count, distribution, types, seed, width, height):
+            file.write(line + '\n')
+
+def sceneLines(count, distribution, types, seed, width, height):
+    # Yields the scene file one line at a time, so a million shapes
+    # never have to be held in memory at once.
+    rng = random.Random(seed)
+
+    yield 'image %d %d' % (width, height)
+    yield 'camera_position 0.0 0.0 %.1f' % (sceneExtent * 3.0)
+    yield 'camera_target 0.0 0.0 0.0'
+    yield 'camera_up 0.0 1.0 0.0'
+
+    # Shapes shrink as the count grows so that the cube stays about
+    # as full, which keeps the number of pixels each ray covers
+    # from swamping the comparison.
+    spacing = 2.0 * sceneExtent / math.ceil(count ** (1.0 / 3.0))
+    centers = shapeCenters(count, distribution, spacing, rng)
+
+    for index, center in enumerate(centers):
+        shapeType = types[index % len(types)]
+        size = spacing * rng.uniform(0.2, 0.45)
+        color = (rng.random(), rng.random(), rng.random())
+        yield ''
+        yield shapeLine(shapeType, center, size, color, rng)
+
+def shapeCenters(count, distribution, spacing, rng):
+    # Yields count shape centers inside the scene cube.
+    if distribution == 'grid':
+        # A regular lattice, filled in row by row.
+        perSide = math.ceil(count ** (1.0 / 3.0))
+        start = -sceneExtent + spacing * 0.5
+        for index in range(count):
+            x = index % perSide
+            y = (index // perSide) % perSide
+            z = index // (perSide * perSide)
+            yield (start + x * spacing, start + y * spacing, start + z * spacing)
+    elif distribution == 'clustered':
+        # Shapes gather around a few random points, leaving most
+        # of the cube empty, as in a scene with a few detailed objects.
+        clusterCount = max(1, int(round(count ** (1.0 / 3.0))))
+        clusters = [randomPoint(rng, sceneExtent * 0.75) for i in range(clusterCount)]
+        spread = sceneExtent * 0.15
+        for index in range(count):
+            cluster = clusters[index % clusterCount]
+            yield tuple(clamp(cluster[axis] + rng.gauss(0.0, spread), -sceneExtent, sceneExtent) for axis in range(3))
+    else:
+        for index in range(count):
+            yield randomPoint(rng, sceneExtent)
+
+def shapeLine(shapeType, center, size, color, rng):
+    # Formats one shape the way readSetupFile expects it.
+    x, y, z = center
+    r, g, b = color
+    if shapeType == 'sphere':
+        return 'sphere %.4f %.4f %.4f %.4f %.3f %.3f %.3f' % (x, y, z, size, r, g, b)
+    if shapeType == 'box':
+        return 'box %.4f %.4f %.4f %.4f %.3f %.3f %.3f' % (x, y, z, size * 1.5, r, g, b)
+    if shapeType == 'cylinder':
+        return 'cylinder %.4f %.4f %.4f %.4f %.4f %.3f %.3f %.3f' % (x, y, z, size * 0.75, size * 2.0, r, g, b)
+
+    # Triangles get three corners scattered around the center.
+    corners = []
+    for corner in range(3):
+        corners.extend(center[axis] + rng.uniform(-size, size) * 1.5 for axis in range(3))
+    return 'triangle ' + ' '.join('%.4f' % value for value in corners) + ' %.3f %.3f %.3f' % (r, g, b)
+
+def randomPoint(rng, extent):
+    return (rng.uniform(-extent, extent), rng.uniform(-extent, extent), rng.uniform(-extent, extent))
+
+def clamp(value, low, high):
+    return max(low, min(high, value))
+
+if __name__ == '__main__':
+    main()
@@ -4,6 +4,23 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <chrono>
+#include <condition_variable>
+#include <iomanip>
+#include <bitset>
+#include <random>
+#include <cstdlib>
+#include <limits>
+#include <algorithm>
+#include <cmath>
+#include <cctype>
+
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
@@ -12,15 +29,71 @@
 #include "CImg.h"
 
 #define EPSILON 1e-6
+#define TILE_SIZE 16
+#define BVH_LEAF_SIZE 4
+#define PROGRESS_INTERVAL_MS 500
+#define BENCH_OPS 4096
+#define BENCH_RUNS 5
+#define BENCH_RUN_SECONDS 0.05
+#define BENCH_MAX_ERROR 1e-4f
+
+// Below this many shapes checking every
+// shape is faster than the hierarchy. The
+// SIMD kernels move that point much higher.
+#if defined(__AVX512F__)
+#define BVH_MIN_SHAPES 2048
+#elif defined(__AVX2__)
+#define BVH_MIN_SHAPES 1024
+#else
+#define BVH_MIN_SHAPES 16
+#endif
+
+// --cull and --tile-cull walk the hierarchy
+// once per ray or tile rather than once per
+// step, so they want it for much smaller
+// scenes.
+#define CULL_BVH_MIN_SHAPES 16
+
+// --tile-cull splits the depths each tile's
+// rays cover into this many slabs.
+#define TILE_CULL_SLABS 64
+
+// --cones marches cones over blocks of this
+// many pixels a side, then over blocks of
+// CONE_FINE_BLOCK_SIZE inside those.
+#define CONE_BLOCK_SIZE 8
+#define CONE_FINE_BLOCK_SIZE 2
 
 // Global Variables:
 glm::vec3 globalCameraPosition;
 glm::vec3 globalCameraTarget;
 glm::vec3 globalCameraUp;
 glm::vec3 globalRayDirection;
+bool globalCameraOrthographic = false;
+float globalCameraOrthoHalfHeight = 1.0f;
 float parentRotationAngle = 0.0f;
 int globalWidth;
 int globalHeight;
+float globalDelta = .001;
+int globalMaxIterations = 100;
+int globalMaxDistance = 100;
+int globalMaxShadowSteps = 256;
+float globalShadowSoftness = 0.0f;
+float globalRelaxation = 1.0f;
+float globalPixelEpsilon = 0.0f;
+float globalHitOffset = 0.0f;
+float globalHitSpread = 0.0f;
+glm::vec3 globalLightPosition(-5.0f, -5.0f, 5.0f);
+#if defined(__AVX2__)
+bool globalPacketMarching = true;
+#else
+bool globalPacketMarching = false;
+#endif
+bool globalRayCulling = false;
+bool globalTileCulling = false;
+bool globalConePrepass = false;
+bool globalShowProgress = true;
+bool globalCollectStats = false;
 
 using namespace cimg_library;
 
@@ -32,7 +105,17 @@ using namespace cimg_library;
 // lighting. The command line argument
 // used to compile the code was as follows:
 
-// g++ -o rayMarcher rayMarcher.cpp -lpng -lpthread -lX11 -lm
+// g++ -O2 -mavx2 -o rayMarcher rayMarcher.cpp -lpng -lpthread -lX11 -lm
+
+// For batch renders on machines without X11:
+
+// g++ -O2 -mavx2 -Dcimg_display=0 -o rayMarcher rayMarcher.cpp -lpng -lpthread -lm
+
+// -mavx2 turns on the eight wide distance
+// kernels (-march=native also picks up the
+// sixteen wide AVX-512 ones where the CPU
+// has them). Leaving it out still works,
+// just one shape at a time.
 
 // Parts of this code are recycled from
 // programs written for other assignments
@@ -119,6 +202,79 @@ struct Shape {
     }
 };
 
+// The Camera struct builds the camera basis
+// once per frame, so no matrix has to be
+// inverted while rendering. Every pixel is
+// described by a point that moves by a fixed
+// step from one column or row to the next,
+// which lets the render loops walk along a
+// row with a single vector addition. In
+// perspective mode the point gives the ray
+// direction, and it matches the rays of
+// the original per-pixel inverse(viewMatrix)
+// code, so old scenes render the same. In
+// orthographic mode the point is the ray
+// origin instead and all rays point the
+// same way. setup also works out how wide
+// a pixel is at any depth along its ray:
+// footprintOffset plus depth times
+// footprintSpread, measured between the
+// center pixel and the one beside it.
+//
+// camera_projection perspective
+//   OR
+// camera_projection orthographic half_height
+
+struct Camera {
+    enum Projection { PERSPECTIVE, ORTHOGRAPHIC };
+    Projection projection;
+    glm::vec3 position;
+    glm::vec3 forward;
+    glm::vec3 pixelOrigin;
+    glm::vec3 pixelStepX;
+    glm::vec3 pixelStepY;
+    float footprintOffset;
+    float footprintSpread;
+
+    void setup(const glm::vec3& eye, const glm::vec3& target, const glm::vec3& up, int width, int height, Projection mode, float orthoHalfHeight) {
+        float aspectRatio = static_cast<float>(width) / height;
+
+        projection = mode;
+        position = eye;
+        forward = glm::normalize(target - eye);
+        glm::vec3 right = glm::normalize(glm::cross(forward, up));
+        glm::vec3 cameraUp = glm::cross(right, forward);
+
+        if (projection == PERSPECTIVE) {
+            pixelOrigin = eye + forward - aspectRatio * right + cameraUp;
+            pixelStepX = right * (2.0f * aspectRatio / width);
+            pixelStepY = -cameraUp * (2.0f / height);
+        }
+        else {
+            pixelOrigin = eye + orthoHalfHeight * (aspectRatio * right - cameraUp);
+            pixelStepX = -right * (2.0f * aspectRatio * orthoHalfHeight / width);
+            pixelStepY = cameraUp * (2.0f * orthoHalfHeight / height);
+        }
+
+        glm::vec3 center = pixelPoint(width / 2, height / 2);
+        glm::vec3 beside = center + pixelStepX;
+        footprintOffset = glm::length(rayOrigin(beside) - rayOrigin(center));
+        footprintSpread = glm::length(rayDirection(beside) - rayDirection(center));
+    }
+
+    glm::vec3 pixelPoint(int x, int y) const {
+        return pixelOrigin + static_cast<float>(x) * pixelStepX + static_cast<float>(y) * pixelStepY;
+    }
+
+    glm::vec3 rayOrigin(const glm::vec3& point) const {
+        return projection == PERSPECTIVE ? position : point;
+    }
+
+    glm::vec3 rayDirection(const glm::vec3& point) const {
+        return projection == PERSPECTIVE ? -glm::normalize(point) : forward;
+    }
+};
+
 // These are the signed distance functions
 // for each shape type. They are used to
 // calculate the distance to the surface
@@ -164,305 +320,2775 @@ float signedDistanceCylinder(const glm::vec3 rayOrigin, const Cylinder& cylinder
     return distanceToSide + distanceToTopBottom;
 }
 
-// The readSetupFile function takes in a
-// file from the user and crafts a scene
-// from its specifications. It goes down
-// every line in the file and performs
-// certain functions based on the given
-// commands.
+// RenderStats counts the work done while
+// rendering a frame. Every thread adds to
+// its own copy in globalThreadStats, so the
+// counters need no locking, and renderImage
+// adds the copies together once the frame
+// is finished. The times are summed over
+// all threads, and are only measured when
+// --stats is given, since reading the clock
+// for every ray isn't free.
 
-void readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
-    std::ifstream file(filename);
+struct RenderStats {
+    long long cameraRays = 0;
+    long long hits = 0;
+    long long marchSteps = 0;
+    long long coneSteps = 0;
+    long long backtracks = 0;
+    long long relaxedSteps = 0;
+    long long sdfEvaluations = 0;
+    long long shadowRays = 0;
+    long long shadowSteps = 0;
+    double setupSeconds = 0.0;
+    double marchSeconds = 0.0;
+    double shadowSeconds = 0.0;
+    double shadingSeconds = 0.0;
 
-    if (!file.is_open()) {
-        std::cerr << "Error: Could not open the setup file.\n";
-        return;
+    void add(const RenderStats& other) {
+        cameraRays += other.cameraRays;
+        hits += other.hits;
+        marchSteps += other.marchSteps;
+        coneSteps += other.coneSteps;
+        backtracks += other.backtracks;
+        relaxedSteps += other.relaxedSteps;
+        sdfEvaluations += other.sdfEvaluations;
+        shadowRays += other.shadowRays;
+        shadowSteps += other.shadowSteps;
+        setupSeconds += other.setupSeconds;
+        marchSeconds += other.marchSeconds;
+        shadowSeconds += other.shadowSeconds;
+        shadingSeconds += other.shadingSeconds;
     }
+};
 
-    std::string line;
-    std::map<std::string, int> objectIndices;
+thread_local RenderStats globalThreadStats;
 
-    while (std::getline(file, line)) {
-        std::istringstream iss(line);
-        std::string command;
-        iss >> command;
+// The statsClock function returns the time
+// in seconds, or always 0 when stats are
+// off, so differences of it can be added to
+// the stage times either way.
 
-        if (command == "image") {
-            iss >> globalWidth >> globalHeight;
-        }
-        else if (command == "camera_position") {
-            glm::vec3 position;
-            iss >> position.x >> position.y >> position.z;
-            globalCameraPosition = position;
-        }
-        else if (command == "camera_target") {
-            glm::vec3 target;
-            iss >> target.x >> target.y >> target.z;
-            globalCameraTarget = target;
-        }
-        else if (command == "camera_up") {
-            glm::vec3 up;
-            iss >> up.x >> up.y >> up.z;
-            globalCameraUp = up;
-        }
-        else if (command == "sphere") {
-            Sphere sphere;
-            iss >> sphere.center.x >> sphere.center.y >> sphere.center.z >> sphere.radius >> sphere.color.r >> sphere.color.g >> sphere.color.b;
-            Shape shape(Shape::SPHERE);
-            shape.setSphere(sphere);
-            shape.applyTransform(glm::mat4(1.0f));
-            scene.emplace_back(shape);
-        }
-        else if (command == "triangle") {
-            Triangle triangle;
-            iss >> triangle.vertex1.x >> triangle.vertex1.y >> triangle.vertex1.z
-                >> triangle.vertex2.x >> triangle.vertex2.y >> triangle.vertex2.z
-                >> triangle.vertex3.x >> triangle.vertex3.y >> triangle.vertex3.z
-                >> triangle.color.r >> triangle.color.g >> triangle.color.b;
-            Shape shape(Shape::TRIANGLE);
-            shape.setTriangle(triangle);
-            shape.applyTransform(glm::mat4(1.0f));
-            scene.emplace_back(shape);
-        }
-        else if (command == "box") {
-            Box box;
-            iss >> box.center.x >> box.center.y >> box.center.z >> box.size >> box.color.r >> box.color.g >> box.color.b;
-            Shape shape(Shape::BOX);
-            shape.setBox(box);
-            shape.applyTransform(glm::mat4(1.0f));
-            scene.emplace_back(shape);
-        }
-        else if (command == "cylinder") {
-            Cylinder cylinder;
-            iss >> cylinder.center.x >> cylinder.center.y >> cylinder.center.z >> cylinder.rad >> cylinder.h >> cylinder.color.r >> cylinder.color.g >> cylinder.color.b;
-            Shape shape(Shape::CYLINDER);
-            shape.setCylinder(cylinder);
-            shape.applyTransform(glm::mat4(1.0f));
-            scene.emplace_back(shape);
+double statsClock() {
+    if (!globalCollectStats) return 0.0;
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The hitEpsilon function returns how close
+// a camera ray has to get to a shape, at a
+// given depth, to count as hitting it. It
+// is delta unless the scene file has
+//
+// pixel_epsilon factor
+//
+// in which case it grows to factor pixel
+// widths, so far away surfaces stop being
+// refined long before the difference could
+// show. main sets globalHitOffset and
+// globalHitSpread from the camera.
+
+inline float hitEpsilon(float depth) {
+    return std::max(globalDelta, globalHitOffset + depth * globalHitSpread);
+}
+
+// The signedDistance function calls the
+// matching signed distance function above
+// for whatever type of shape it is given.
+
+float signedDistance(const glm::vec3& point, const Shape& shape) {
+    globalThreadStats.sdfEvaluations++;
+    if (shape.type == Shape::SPHERE) {
+        return signedDistanceSphere(point, shape.sphere);
+    } else if (shape.type == Shape::TRIANGLE) {
+        return signedDistanceTriangle(point, shape.triangle);
+    } else if (shape.type == Shape::BOX) {
+        return signedDistanceBox(point, shape.box);
+    } else if (shape.type == Shape::CYLINDER) {
+        return signedDistanceCylinder(point, shape.cylinder);
+    }
+    return std::numeric_limits<float>::infinity();
+}
+
+// SceneHit is the result of a scene
+// distance query: the distance to the
+// closest shape and that shape's index
+// in the scene (-1 if nothing was found).
+
+struct SceneHit {
+    float distance;
+    int index;
+};
+
+// The shapeBounds function finds the axis
+// aligned box that fully contains a shape.
+// Boxes and cylinders are not rotated, so
+// their bounds come straight from their
+// center and size.
+
+void shapeBounds(const Shape& shape, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+    if (shape.type == Shape::SPHERE) {
+        boundsMin = shape.sphere.center - glm::vec3(shape.sphere.radius);
+        boundsMax = shape.sphere.center + glm::vec3(shape.sphere.radius);
+    } else if (shape.type == Shape::TRIANGLE) {
+        boundsMin = glm::min(shape.triangle.vertex1, glm::min(shape.triangle.vertex2, shape.triangle.vertex3));
+        boundsMax = glm::max(shape.triangle.vertex1, glm::max(shape.triangle.vertex2, shape.triangle.vertex3));
+    } else if (shape.type == Shape::BOX) {
+        boundsMin = shape.box.center - glm::vec3(0.5f * shape.box.size);
+        boundsMax = shape.box.center + glm::vec3(0.5f * shape.box.size);
+    } else {
+        glm::vec3 extent(shape.cylinder.rad, 0.5f * shape.cylinder.h, shape.cylinder.rad);
+        boundsMin = shape.cylinder.center - extent;
+        boundsMax = shape.cylinder.center + extent;
+    }
+}
+
+// The boxDistance function returns how far a
+// point is from an axis aligned box, or 0 if
+// the point is inside it. Since a shape lies
+// inside its bounds, its signed distance can
+// never be smaller than this.
+
+float boxDistance(const glm::vec3& point, const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+    glm::vec3 outside = glm::max(glm::max(boundsMin - point, point - boundsMax), glm::vec3(0.0f));
+    return glm::length(outside);
+}
+
+// The BvhNode struct is one node of the
+// bounding volume hierarchy. A leaf holds
+// shapeCount shapes starting at first in
+// the hierarchy's shape index list. An inner
+// node has shapeCount 0, and its two
+// children are the nodes first and first + 1.
+
+struct BvhNode {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    int first;
+    int shapeCount;
+};
+
+// The SdfBvh struct is a bounding volume
+// hierarchy over the shapes of a scene. The
+// nearest function answers "which shape is
+// closest to this point" by walking the
+// tree nearest box first and skipping every
+// box that is already further away than the
+// closest shape found so far. This makes a
+// distance query roughly logarithmic in the
+// number of shapes instead of linear, and
+// it returns the same result as checking
+// every shape.
+
+struct SdfBvh {
+    std::vector<BvhNode> nodes;
+    std::vector<int> shapeIndices;
+
+    void build(const std::vector<Shape>& shapes, int minShapes = BVH_MIN_SHAPES) {
+        nodes.clear();
+        shapeIndices.clear();
+
+        // Small scenes are quicker to scan directly.
+        if (static_cast<int>(shapes.size()) < minShapes) return;
+
+        std::vector<glm::vec3> boundsMins(shapes.size());
+        std::vector<glm::vec3> boundsMaxs(shapes.size());
+        for (size_t i = 0; i < shapes.size(); i++) {
+            shapeBounds(shapes[i], boundsMins[i], boundsMaxs[i]);
+            shapeIndices.push_back(static_cast<int>(i));
         }
-        else if (command == "name") {
-            std::string objectName;
-            iss >> objectName;
-            objectIndices[objectName] = static_cast<int>(scene.size()) - 1;
+
+        nodes.reserve(2 * shapes.size());
+        nodes.push_back(BvhNode());
+        buildNode(0, 0, static_cast<int>(shapes.size()), boundsMins, boundsMaxs);
+    }
+
+    // Nodes are split at the median shape along
+    // the longest axis of their shapes' centers.
+    void buildNode(int nodeIndex, int first, int count, const std::vector<glm::vec3>& boundsMins, const std::vector<glm::vec3>& boundsMaxs) {
+        glm::vec3 boundsMin(std::numeric_limits<float>::infinity());
+        glm::vec3 boundsMax(-std::numeric_limits<float>::infinity());
+        glm::vec3 centerMin(std::numeric_limits<float>::infinity());
+        glm::vec3 centerMax(-std::numeric_limits<float>::infinity());
+
+        for (int i = first; i < first + count; i++) {
+            int shapeIndex = shapeIndices[i];
+            glm::vec3 center = 0.5f * (boundsMins[shapeIndex] + boundsMaxs[shapeIndex]);
+            boundsMin = glm::min(boundsMin, boundsMins[shapeIndex]);
+            boundsMax = glm::max(boundsMax, boundsMaxs[shapeIndex]);
+            centerMin = glm::min(centerMin, center);
+            centerMax = glm::max(centerMax, center);
         }
-        else if (command == "parent") { // Vestigial Code
-            std::string parentName;
-            iss >> parentName;
-            int childIndex = static_cast<int>(scene.size()) - 1;
 
-            if (objectIndices.find(parentName) != objectIndices.end()) {
-                int parentIndex = objectIndices[parentName];
-                glm::mat4 currentTransform = scene[childIndex].getTransform();
-                scene[childIndex].applyTransform(currentTransform);
-                scene[parentIndex].children.push_back(childIndex);
-            }
+        nodes[nodeIndex].boundsMin = boundsMin;
+        nodes[nodeIndex].boundsMax = boundsMax;
+
+        if (count <= BVH_LEAF_SIZE) {
+            nodes[nodeIndex].first = first;
+            nodes[nodeIndex].shapeCount = count;
+            return;
         }
-        else if (command == "transform") { // Vestigial Code
-            glm::mat4 transformMatrix = glm::mat4(1.0f);
 
-            for (int i = 0; i < 4; i++) {
-                for (int j = 0; j < 4; j++) {
-                    iss >> transformMatrix[j][i];
+        glm::vec3 extent = centerMax - centerMin;
+        int axis = 0;
+        if (extent.y > extent.x) axis = 1;
+        if (extent.z > extent[axis]) axis = 2;
+
+        int middle = first + count / 2;
+        std::nth_element(shapeIndices.begin() + first, shapeIndices.begin() + middle, shapeIndices.begin() + first + count,
+                         [&](int a, int b) {
+                             return boundsMins[a][axis] + boundsMaxs[a][axis] < boundsMins[b][axis] + boundsMaxs[b][axis];
+                         });
+
+        int leftChild = static_cast<int>(nodes.size());
+        nodes.push_back(BvhNode());
+        nodes.push_back(BvhNode());
+        nodes[nodeIndex].first = leftChild;
+        nodes[nodeIndex].shapeCount = 0;
+
+        buildNode(leftChild, first, middle - first, boundsMins, boundsMaxs);
+        buildNode(leftChild + 1, middle, first + count - middle, boundsMins, boundsMaxs);
+    }
+
+    SceneHit nearest(const glm::vec3& point, const std::vector<Shape>& shapes, int ignoredIndex) const {
+        SceneHit closest = { std::numeric_limits<float>::infinity(), -1 };
+        int stackNodes[64];
+        float stackDistances[64];
+        int stackSize = 0;
+
+        stackNodes[stackSize] = 0;
+        stackDistances[stackSize++] = boxDistance(point, nodes[0].boundsMin, nodes[0].boundsMax);
+
+        while (stackSize > 0) {
+            stackSize--;
+            const BvhNode& node = nodes[stackNodes[stackSize]];
+
+            // A box the point is inside of can still hold a shape
+            // with a more negative distance, so it is never skipped.
+            float nodeDistance = stackDistances[stackSize];
+            if (nodeDistance > 0.0f && nodeDistance > closest.distance) continue;
+
+            if (node.shapeCount > 0) {
+                for (int i = node.first; i < node.first + node.shapeCount; i++) {
+                    int shapeIndex = shapeIndices[i];
+                    if (shapeIndex == ignoredIndex) continue;
+
+                    float dist = signedDistance(point, shapes[shapeIndex]);
+                    if (dist < closest.distance || (dist == closest.distance && shapeIndex < closest.index)) {
+                        closest.distance = dist;
+                        closest.index = shapeIndex;
+                    }
                 }
+                continue;
             }
 
-            scene.back().applyTransform(transformMatrix);
+            const BvhNode& left = nodes[node.first];
+            const BvhNode& right = nodes[node.first + 1];
+            float leftDistance = boxDistance(point, left.boundsMin, left.boundsMax);
+            float rightDistance = boxDistance(point, right.boundsMin, right.boundsMax);
+
+            // The nearer child is pushed last so it is searched first.
+            if (leftDistance <= rightDistance) {
+                stackNodes[stackSize] = node.first + 1;
+                stackDistances[stackSize++] = rightDistance;
+                stackNodes[stackSize] = node.first;
+                stackDistances[stackSize++] = leftDistance;
+            } else {
+                stackNodes[stackSize] = node.first;
+                stackDistances[stackSize++] = leftDistance;
+                stackNodes[stackSize] = node.first + 1;
+                stackDistances[stackSize++] = rightDistance;
+            }
         }
+
+        return closest;
+    }
+};
+
+// SimdFloat holds SIMD_WIDTH floats that are
+// worked on together. When the program is
+// compiled with AVX-512 every operation below
+// is one instruction on sixteen floats, and
+// with AVX2 (-mavx2) one instruction on eight.
+// Without either the same operations are
+// plain loops, so the program still builds
+// and gives the same answers on any machine.
+// Comparisons return a SimdMask that
+// simdSelect uses to pick between two values,
+// and simdBits turns into one bit per lane.
+
+#if defined(__AVX512F__)
+
+#define SIMD_WIDTH 16
+
+struct SimdFloat {
+    __m512 v;
+    SimdFloat() {}
+    SimdFloat(__m512 value) : v(value) {}
+    SimdFloat(float value) : v(_mm512_set1_ps(value)) {}
+
+    static SimdFloat load(const float* values) { return _mm512_loadu_ps(values); }
+    void store(float* values) const { _mm512_storeu_ps(values, v); }
+};
+
+struct SimdMask {
+    __mmask16 v;
+    SimdMask(__mmask16 value) : v(value) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm512_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm512_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm512_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm512_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm512_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm512_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm512_sqrt_ps(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return _mm512_abs_ps(a.v); }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ); }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { return static_cast<__mmask16>(a.v & b.v); }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { return static_cast<__mmask16>(a.v | b.v); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { return _mm512_mask_blend_ps(mask.v, b.v, a.v); }
+inline int simdBits(SimdMask mask) { return mask.v; }
+
+#elif defined(__AVX2__)
+
+#define SIMD_WIDTH 8
+
+struct SimdFloat {
+    __m256 v;
+    SimdFloat() {}
+    SimdFloat(__m256 value) : v(value) {}
+    SimdFloat(float value) : v(_mm256_set1_ps(value)) {}
+
+    static SimdFloat load(const float* values) { return _mm256_loadu_ps(values); }
+    void store(float* values) const { _mm256_storeu_ps(values, v); }
+};
+
+struct SimdMask {
+    __m256 v;
+    SimdMask(__m256 value) : v(value) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { return _mm256_and_ps(a.v, b.v); }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { return _mm256_or_ps(a.v, b.v); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int simdBits(SimdMask mask) { return _mm256_movemask_ps(mask.v); }
+
+#else
+
+#define SIMD_WIDTH 8
+
+struct SimdFloat {
+    float v[SIMD_WIDTH];
+    SimdFloat() {}
+    SimdFloat(float value) { for (int i = 0; i < SIMD_WIDTH; i++) v[i] = value; }
+
+    static SimdFloat load(const float* values) {
+        SimdFloat result;
+        for (int i = 0; i < SIMD_WIDTH; i++) result.v[i] = values[i];
+        return result;
+    }
+    void store(float* values) const { for (int i = 0; i < SIMD_WIDTH; i++) values[i] = v[i]; }
+};
+
+struct SimdMask {
+    bool v[SIMD_WIDTH];
+};
+
+#define SIMD_LANEWISE(type, expression) type result; for (int i = 0; i < SIMD_WIDTH; i++) result.v[i] = (expression); return result;
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] + b.v[i]) }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] - b.v[i]) }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] * b.v[i]) }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] / b.v[i]) }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat simdSqrt(SimdFloat a) { SIMD_LANEWISE(SimdFloat, std::sqrt(a.v[i])) }
+inline SimdFloat simdAbs(SimdFloat a) { SIMD_LANEWISE(SimdFloat, std::fabs(a.v[i])) }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdMask, a.v[i] < b.v[i]) }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdMask, a.v[i] == b.v[i]) }
+inline SimdMask simdAnd(SimdMask a, SimdMask b) { SIMD_LANEWISE(SimdMask, a.v[i] && b.v[i]) }
+inline SimdMask simdOr(SimdMask a, SimdMask b) { SIMD_LANEWISE(SimdMask, a.v[i] || b.v[i]) }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, mask.v[i] ? a.v[i] : b.v[i]) }
+
+#undef SIMD_LANEWISE
+
+inline int simdBits(SimdMask mask) {
+    int bits = 0;
+    for (int i = 0; i < SIMD_WIDTH; i++) {
+        if (mask.v[i]) bits |= 1 << i;
     }
+    return bits;
 }
 
-// This is the main function of this
-// program, which includes the ray
-// marching and lighting code. It
-// takes no parameters from the user,
-// but instead calls in a scene
-// description file with instructions
-// for how the scene is laid out.
+#endif
 
-int main() {
-    float delta = .001;
-    int maxIterations = 100;
-    int maxDistance = 100;
-    std::vector<Shape> originalScene;
-    std::vector<Shape> scene;
-    readSetupFile("scene.txt", scene);
+// glm::sign for SIMD_WIDTH values at once:
+// 1 for positive, -1 for negative, 0 for 0.
 
-    const int width = globalWidth;
-    const int height = globalHeight;
+inline SimdFloat simdSign(SimdFloat a) {
+    SimdFloat zero(0.0f);
+    return simdSelect(simdLess(zero, a), SimdFloat(1.0f), zero) - simdSelect(simdLess(a, zero), SimdFloat(1.0f), zero);
+}
 
-    CImg<unsigned char> image(width, height, 1, 3, 0);
+// SimdVec3 is SIMD_WIDTH points or vectors
+// stored as one SimdFloat per axis.
 
-    glm::mat4 viewMatrix = glm::lookAt(globalCameraPosition, globalCameraTarget, globalCameraUp);
+struct SimdVec3 {
+    SimdFloat x, y, z;
+    SimdVec3() {}
+    SimdVec3(SimdFloat x, SimdFloat y, SimdFloat z) : x(x), y(y), z(z) {}
+    SimdVec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
 
-    float aspectRatio = static_cast<float>(width) / height;
+inline SimdVec3 operator-(const SimdVec3& a, const SimdVec3& b) { return SimdVec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline SimdVec3 operator*(const SimdVec3& a, SimdFloat s) { return SimdVec3(a.x * s, a.y * s, a.z * s); }
+inline SimdFloat simdDot(const SimdVec3& a, const SimdVec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
 
-    // Ray Marching Loop
-    for (int y = 0; y < height; y++) {
-        for (int x = 0; x < width; x++) {
-	    std::cout << x << " " << y << std::endl;
-            float distTraveled = 0;
-            float minSignedDistance = 100;
-            float signedDist;
-            bool hitFound = false;
-	    bool colorPicked = false;
-            glm::vec3 color = glm::vec3(0.0f, 0.0f, 0.0f);
-	    
-            float ndcX = aspectRatio * ((2.0f * x) / width - 1.0f);
-            float ndcY = 1.0f - (2.0f * y) / height;
-            glm::vec4 clipCoords(ndcX, ndcY, -1.0f, 1.0f);
-            glm::vec4 eyeCoords = glm::inverse(viewMatrix) * clipCoords;
-            glm::vec3 rayDirection = -glm::normalize(glm::vec3(eyeCoords));
-            
-            glm::vec3 currentCoords;
-            int iterations = 0;
-
-            while (iterations < maxIterations && distTraveled < maxDistance && !colorPicked) {
-                for (const auto& shape : scene) {
-		  hitFound = false;
-                    currentCoords = globalCameraPosition + (distTraveled * rayDirection);
-                    if (shape.type == Shape::TRIANGLE) {
-                        signedDist = signedDistanceTriangle(currentCoords, shape.triangle);
-                        if (signedDist < delta) {
-                          color = shape.triangle.color;
-                          hitFound = true;
-                        }
-                        else if (signedDist <= minSignedDistance) {
-                          minSignedDistance = signedDist;
-                        }
-                    }
-                    else if (shape.type == Shape::SPHERE) {
-                        signedDist = signedDistanceSphere(currentCoords, shape.sphere);
-                        if (signedDist < delta) {
-                          color = shape.sphere.color;
-                          hitFound = true;
-                        }
-                        else if (signedDist <= minSignedDistance) {
-                          minSignedDistance = signedDist;
-                        }
-                    }
-                    else if (shape.type == Shape::BOX) {
-                        signedDist = signedDistanceBox(currentCoords, shape.box);
-                        if (signedDist < delta) {
-                          color = shape.box.color;
-                          hitFound = true;
-                        }
-                        else if (signedDist <= minSignedDistance) {
-                          minSignedDistance = signedDist;
-                        }
-                    }
-                    else if (shape.type == Shape::CYLINDER) {
-                        signedDist = signedDistanceCylinder(currentCoords, shape.cylinder);
-                        if (signedDist < delta) {
-                          color = shape.cylinder.color;
-                          hitFound = true;
-                        }
-                        else if (signedDist <= minSignedDistance) {
-                          minSignedDistance = signedDist;
-                        }
-                    }
+// SimdTriangle is SIMD_WIDTH triangles with
+// everything signedDistanceTriangle works
+// out from the vertices stored ahead of time.
 
-		    // Lighting Calculations
-		    if (hitFound) {
-		      using namespace glm;
-		      vec3 normalVector;
-		      vec3 ambientColor = vec3(0.1f, 0.1f, 0.1f);
-		      vec3 lightPosition(-5.0f, -5.0f, 5.0f);
-		      vec3 lightDirection = normalize(lightPosition - currentCoords);
-		      
-		      if (shape.type == Shape::SPHERE) {
-			normalVector = normalize(currentCoords - shape.sphere.center);
-		      }
-		      else if (shape.type == Shape::TRIANGLE) {
-		        vec3 edge1 = shape.triangle.vertex2 - shape.triangle.vertex1;
-			vec3 edge2 = shape.triangle.vertex3 - shape.triangle.vertex1;
-			
-		        normalVector = -normalize(cross(edge1, edge2));
-		      }
-		      else if (shape.type == Shape::BOX) {
-		        normalVector = normalize(currentCoords - shape.box.center);
-			float maxComponent = max(abs(normalVector.x), max(abs(normalVector.y), abs(normalVector.z)));
-
-			if (abs(maxComponent - abs(normalVector.x)) < EPSILON) {
-			  normalVector.x = glm::sign(normalVector.x);
-			  normalVector.y = normalVector.z = 0.0f;
-			} else if (abs(maxComponent - abs(normalVector.y)) < EPSILON) {
-			  normalVector.y = glm::sign(normalVector.y);
-			  normalVector.x = normalVector.z = 0.0f;
-			} else if (abs(maxComponent - abs(normalVector.z)) < EPSILON) {
-			  normalVector.z = glm::sign(normalVector.z);
-			  normalVector.x = normalVector.y = 0.0f;
-			}
-
-		      }
-		      else if (shape.type == Shape::CYLINDER) {
-		        vec2 d = abs(vec2(length(vec2(currentCoords.x, currentCoords.z) - vec2(shape.cylinder.center.x, shape.cylinder.center.z)), currentCoords.y - shape.cylinder.center.y)) - vec2(shape.cylinder.rad, shape.cylinder.h * 0.5f);
-
-			if (length(d) < EPSILON) {
-			  normalVector = normalize(vec3(0.0f, glm::sign(currentCoords.y - shape.cylinder.center.y), 0.0f));
-			} else {
-			  normalVector = normalize(vec3(currentCoords.x - shape.cylinder.center.x, 0.0f, currentCoords.z - shape.cylinder.center.z));
-			}
-		      }
-
-		      // Shadow Calculations
-		      bool inShadow = false;
-		      vec3 shadowRayDirection = normalize(lightPosition - currentCoords);
-		      float shadowRayDistance = glm::length(lightPosition - currentCoords);
-		      
-		      for (float t = delta; t < shadowRayDistance; t+= delta) {
-			if (inShadow) break;
-
-			vec3 shadowRayOrigin = currentCoords + t * shadowRayDirection;
-			for (const auto& otherShape : scene) {
-			  if (&otherShape != &shape) {
-			    float shadowDist = 1;
-			    if (otherShape.type == Shape::SPHERE) {
-			      shadowDist = signedDistanceSphere(shadowRayOrigin, otherShape.sphere);
-			    } else if (otherShape.type == Shape::BOX) {
-			      shadowDist = signedDistanceBox(shadowRayOrigin, otherShape.box);
-			    } else if (otherShape.type == Shape::TRIANGLE) {
-			      shadowDist = signedDistanceTriangle(shadowRayOrigin, otherShape.triangle);
-			    } else if (otherShape.type == Shape::CYLINDER) {
-			      shadowDist = signedDistanceCylinder(shadowRayOrigin, otherShape.cylinder);
-			    }
-			    if (shadowDist < delta) {
-			      inShadow = true;
-			      break;
-			    }
-			  }
-			}
-		      }
-
-		      // More Lighting Calculations
-		      float diffuseIntensity = glm::max(0.0f, dot(normalVector, lightDirection));
-
-		      // Diffuse Lighting Calculations
-		      vec3 diffuseColor = shape.color;
-		      vec3 lightColor = vec3(1.0f, 1.0f, 1.0f);
-
-		      // Specular Lighting Calculations
-		      float shininess = 10.0f;
-		      vec3 viewDirection = normalize(globalCameraPosition - currentCoords);
-		      vec3 reflectionDirection = reflect(-lightDirection, normalVector);
-		      float specularIntensity = pow(max(0.0f, dot(viewDirection, reflectionDirection)), shininess);
-		      vec3 specularColor = vec3(0.5f, 0.5f, 0.5f);
-
-		      // Color Formula
-		      color = glm::clamp(ambientColor + diffuseIntensity * diffuseColor * lightColor + specularIntensity * specularColor, 0.0f, 1.0f);
-		      if (inShadow) color = color * 0.2f;
-		      
-		      colorPicked = true;
-	            }
-                }
-                distTraveled += minSignedDistance;
-                iterations += 1;
-            }
+struct SimdTriangle {
+    SimdVec3 vertex1, vertex2, vertex3;
+    SimdVec3 edge21, edge32, edge13;
+    SimdVec3 side21, side32, side13;
+    SimdVec3 normal;
+    SimdFloat length21, length32, length13, normalLength;
+};
+
+// These are the signed distance functions
+// from above, written for SIMD_WIDTH points
+// and shapes at once. They follow the scalar
+// versions step by step so both give the
+// same distances.
+
+inline SimdFloat simdSignedDistanceSphere(const SimdVec3& point, const SimdVec3& center, SimdFloat radius) {
+    SimdVec3 offset = point - center;
+    return simdSqrt(simdDot(offset, offset)) - radius;
+}
+
+inline SimdFloat simdEdgeDistance(const SimdVec3& edge, SimdFloat edgeLength, const SimdVec3& offset) {
+    SimdFloat along = simdMin(simdMax(simdDot(edge, offset) / edgeLength, SimdFloat(0.0f)), SimdFloat(1.0f));
+    SimdVec3 toEdge = edge * along - offset;
+    return simdDot(toEdge, toEdge);
+}
+
+inline SimdFloat simdSignedDistanceTriangle(const SimdVec3& point, const SimdTriangle& triangle) {
+    SimdVec3 p1 = point - triangle.vertex1;
+    SimdVec3 p2 = point - triangle.vertex2;
+    SimdVec3 p3 = point - triangle.vertex3;
+
+    SimdMask outside = simdLess(simdSign(simdDot(triangle.side21, p1)) +
+        simdSign(simdDot(triangle.side32, p2)) +
+        simdSign(simdDot(triangle.side13, p3)), SimdFloat(2.0f));
+
+    SimdFloat edgeDistance = simdMin(simdMin(
+        simdEdgeDistance(triangle.edge21, triangle.length21, p1),
+        simdEdgeDistance(triangle.edge32, triangle.length32, p2)),
+        simdEdgeDistance(triangle.edge13, triangle.length13, p3));
+    SimdFloat height = simdDot(triangle.normal, p1);
+    SimdFloat planeDistance = height * height / triangle.normalLength;
+
+    return simdSqrt(simdSelect(outside, edgeDistance, planeDistance));
+}
+
+inline SimdFloat simdSignedDistanceBox(const SimdVec3& point, const SimdVec3& center, SimdFloat halfSize) {
+    SimdFloat zero(0.0f);
+    SimdFloat qx = simdAbs(point.x - center.x) - halfSize;
+    SimdFloat qy = simdAbs(point.y - center.y) - halfSize;
+    SimdFloat qz = simdAbs(point.z - center.z) - halfSize;
+    SimdVec3 outside(simdMax(qx, zero), simdMax(qy, zero), simdMax(qz, zero));
+    return simdSqrt(simdDot(outside, outside)) + simdMin(simdMax(qx, simdMax(qy, qz)), zero);
+}
+
+inline SimdFloat simdSignedDistanceCylinder(const SimdVec3& point, const SimdVec3& center, SimdFloat radius, SimdFloat halfHeight) {
+    SimdFloat zero(0.0f);
+    SimdFloat offsetX = point.x - center.x;
+    SimdFloat offsetZ = point.z - center.z;
+    SimdFloat dx = simdAbs(simdSqrt(offsetX * offsetX + offsetZ * offsetZ)) - radius;
+    SimdFloat dy = simdAbs(point.y - center.y) - halfHeight;
+    SimdFloat outsideX = simdMax(dx, zero);
+    SimdFloat outsideY = simdMax(dy, zero);
+    return simdSqrt(outsideX * outsideX + outsideY * outsideY) + simdMin(simdMax(dx, dy), zero);
+}
+
+// SoaVec3 stores a list of points or vectors
+// as three separate lists, one per axis, so
+// SIMD_WIDTH neighbouring entries can be
+// loaded with one instruction per axis.
+
+struct SoaVec3 {
+    std::vector<float> x, y, z;
 
-            image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
-            image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
-            image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+    void push(const glm::vec3& v) {
+        x.push_back(v.x);
+        y.push_back(v.y);
+        z.push_back(v.z);
+    }
+
+    SimdVec3 load(int i) const {
+        return SimdVec3(SimdFloat::load(&x[i]), SimdFloat::load(&y[i]), SimdFloat::load(&z[i]));
+    }
+};
+
+// The SoaScene struct is a second copy of
+// the scene's shapes laid out for the SIMD
+// kernels above. Each shape type has its own
+// lists (sphere centers and radii, box
+// centers and sizes, and so on) together
+// with each shape's index in the scene.
+// Every list is padded to a multiple of
+// SIMD_WIDTH with far away shapes whose
+// index is -1, so the kernels never need a
+// partial load.
+
+#define SOA_FAR_AWAY 1e18f
+
+struct SoaScene {
+    int shapeCount = 0;
+
+    SoaVec3 sphereCenters;
+    std::vector<float> sphereRadii, sphereIndices;
+
+    SoaVec3 boxCenters;
+    std::vector<float> boxHalfSizes, boxIndices;
+
+    SoaVec3 cylinderCenters;
+    std::vector<float> cylinderRadii, cylinderHalfHeights, cylinderIndices;
+
+    SoaVec3 triangleVertex1, triangleVertex2, triangleVertex3;
+    SoaVec3 triangleEdge21, triangleEdge32, triangleEdge13;
+    SoaVec3 triangleSide21, triangleSide32, triangleSide13;
+    SoaVec3 triangleNormal;
+    std::vector<float> triangleLength21, triangleLength32, triangleLength13, triangleNormalLength, triangleIndices;
+
+    // Shape indices are kept as floats so they
+    // can be blended in the same registers as
+    // the distances. Floats hold every integer
+    // up to 16 million exactly.
+    void build(const std::vector<Shape>& shapes) {
+        *this = SoaScene();
+        shapeCount = static_cast<int>(shapes.size());
+
+        for (int i = 0; i < static_cast<int>(shapes.size()); i++) {
+            addShape(shapes[i], static_cast<float>(i));
+        }
+
+        Sphere farSphere = { glm::vec3(SOA_FAR_AWAY), 0.0f, glm::vec3(0.0f) };
+        while (sphereIndices.size() % SIMD_WIDTH != 0) addSphere(farSphere, -1.0f);
+
+        Box farBox = { glm::vec3(SOA_FAR_AWAY), 0.0f, glm::vec3(0.0f) };
+        while (boxIndices.size() % SIMD_WIDTH != 0) addBox(farBox, -1.0f);
+
+        Cylinder farCylinder = { glm::vec3(SOA_FAR_AWAY), 0.0f, 0.0f, glm::vec3(0.0f) };
+        while (cylinderIndices.size() % SIMD_WIDTH != 0) addCylinder(farCylinder, -1.0f);
+
+        Triangle farTriangle = { glm::vec3(SOA_FAR_AWAY, 0.0f, 0.0f), glm::vec3(SOA_FAR_AWAY, 1.0f, 0.0f),
+                                 glm::vec3(SOA_FAR_AWAY, 0.0f, 1.0f), glm::vec3(0.0f) };
+        while (triangleIndices.size() % SIMD_WIDTH != 0) addTriangle(farTriangle, -1.0f);
+    }
+
+    void addShape(const Shape& shape, float index) {
+        if (shape.type == Shape::SPHERE) {
+            addSphere(shape.sphere, index);
+        } else if (shape.type == Shape::TRIANGLE) {
+            addTriangle(shape.triangle, index);
+        } else if (shape.type == Shape::BOX) {
+            addBox(shape.box, index);
+        } else if (shape.type == Shape::CYLINDER) {
+            addCylinder(shape.cylinder, index);
         }
     }
+
+    void addSphere(const Sphere& sphere, float index) {
+        sphereCenters.push(sphere.center);
+        sphereRadii.push_back(sphere.radius);
+        sphereIndices.push_back(index);
+    }
+
+    void addBox(const Box& box, float index) {
+        boxCenters.push(box.center);
+        boxHalfSizes.push_back(0.5f * box.size);
+        boxIndices.push_back(index);
+    }
+
+    void addCylinder(const Cylinder& cylinder, float index) {
+        cylinderCenters.push(cylinder.center);
+        cylinderRadii.push_back(cylinder.rad);
+        cylinderHalfHeights.push_back(cylinder.h * 0.5f);
+        cylinderIndices.push_back(index);
+    }
+
+    void addTriangle(const Triangle& triangle, float index) {
+        glm::vec3 v21 = triangle.vertex2 - triangle.vertex1;
+        glm::vec3 v32 = triangle.vertex3 - triangle.vertex2;
+        glm::vec3 v13 = triangle.vertex1 - triangle.vertex3;
+        glm::vec3 nor = glm::cross(v21, v13);
+
+        triangleVertex1.push(triangle.vertex1);
+        triangleVertex2.push(triangle.vertex2);
+        triangleVertex3.push(triangle.vertex3);
+        triangleEdge21.push(v21);
+        triangleEdge32.push(v32);
+        triangleEdge13.push(v13);
+        triangleSide21.push(glm::cross(v21, nor));
+        triangleSide32.push(glm::cross(v32, nor));
+        triangleSide13.push(glm::cross(v13, nor));
+        triangleNormal.push(nor);
+        triangleLength21.push_back(glm::dot(v21, v21));
+        triangleLength32.push_back(glm::dot(v32, v32));
+        triangleLength13.push_back(glm::dot(v13, v13));
+        triangleNormalLength.push_back(glm::dot(nor, nor));
+        triangleIndices.push_back(index);
+    }
+
+    SimdTriangle loadTriangles(int i) const {
+        SimdTriangle triangles;
+        triangles.vertex1 = triangleVertex1.load(i);
+        triangles.vertex2 = triangleVertex2.load(i);
+        triangles.vertex3 = triangleVertex3.load(i);
+        triangles.edge21 = triangleEdge21.load(i);
+        triangles.edge32 = triangleEdge32.load(i);
+        triangles.edge13 = triangleEdge13.load(i);
+        triangles.side21 = triangleSide21.load(i);
+        triangles.side32 = triangleSide32.load(i);
+        triangles.side13 = triangleSide13.load(i);
+        triangles.normal = triangleNormal.load(i);
+        triangles.length21 = SimdFloat::load(&triangleLength21[i]);
+        triangles.length32 = SimdFloat::load(&triangleLength32[i]);
+        triangles.length13 = SimdFloat::load(&triangleLength13[i]);
+        triangles.normalLength = SimdFloat::load(&triangleNormalLength[i]);
+        return triangles;
+    }
+
+    static SimdVec3 broadcast(const SoaVec3& list, int i) {
+        return SimdVec3(SimdFloat(list.x[i]), SimdFloat(list.y[i]), SimdFloat(list.z[i]));
+    }
+
+    SimdTriangle broadcastTriangle(int i) const {
+        SimdTriangle triangle;
+        triangle.vertex1 = broadcast(triangleVertex1, i);
+        triangle.vertex2 = broadcast(triangleVertex2, i);
+        triangle.vertex3 = broadcast(triangleVertex3, i);
+        triangle.edge21 = broadcast(triangleEdge21, i);
+        triangle.edge32 = broadcast(triangleEdge32, i);
+        triangle.edge13 = broadcast(triangleEdge13, i);
+        triangle.side21 = broadcast(triangleSide21, i);
+        triangle.side32 = broadcast(triangleSide32, i);
+        triangle.side13 = broadcast(triangleSide13, i);
+        triangle.normal = broadcast(triangleNormal, i);
+        triangle.length21 = SimdFloat(triangleLength21[i]);
+        triangle.length32 = SimdFloat(triangleLength32[i]);
+        triangle.length13 = SimdFloat(triangleLength13[i]);
+        triangle.normalLength = SimdFloat(triangleNormalLength[i]);
+        return triangle;
+    }
+
+    // The keepClosest function folds SIMD_WIDTH
+    // new distances into the closest distance
+    // and index found so far in each lane. The
+    // ignored shape is given an infinite
+    // distance, and ties go to the lower index
+    // like the scalar loop.
+    static void keepClosest(SimdFloat distances, SimdFloat indices, SimdFloat ignored,
+                            SimdFloat& closestDistances, SimdFloat& closestIndices) {
+        distances = simdSelect(simdEqual(indices, ignored), SimdFloat(std::numeric_limits<float>::infinity()), distances);
+        SimdMask closer = simdOr(simdLess(distances, closestDistances),
+                                  simdAnd(simdEqual(distances, closestDistances), simdLess(indices, closestIndices)));
+        closestDistances = simdSelect(closer, distances, closestDistances);
+        closestIndices = simdSelect(closer, indices, closestIndices);
+    }
+
+    // The nearestPacket function is nearest
+    // turned around: it finds the closest
+    // shape to SIMD_WIDTH points at once (one
+    // per lane) by running each kernel on
+    // every point for one shape at a time.
+    // Each lane has its own ignored index.
+    void nearestPacket(const SimdVec3& points, SimdFloat ignored,
+                       SimdFloat& closestDistances, SimdFloat& closestIndices) const {
+        closestDistances = SimdFloat(std::numeric_limits<float>::infinity());
+        closestIndices = SimdFloat(-1.0f);
+
+        for (int i = 0; i < static_cast<int>(sphereIndices.size()) && sphereIndices[i] >= 0.0f; i++) {
+            SimdFloat distances = simdSignedDistanceSphere(points, broadcast(sphereCenters, i), SimdFloat(sphereRadii[i]));
+            keepClosest(distances, SimdFloat(sphereIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(boxIndices.size()) && boxIndices[i] >= 0.0f; i++) {
+            SimdFloat distances = simdSignedDistanceBox(points, broadcast(boxCenters, i), SimdFloat(boxHalfSizes[i]));
+            keepClosest(distances, SimdFloat(boxIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(cylinderIndices.size()) && cylinderIndices[i] >= 0.0f; i++) {
+            SimdFloat distances = simdSignedDistanceCylinder(points, broadcast(cylinderCenters, i), SimdFloat(cylinderRadii[i]),
+                                                             SimdFloat(cylinderHalfHeights[i]));
+            keepClosest(distances, SimdFloat(cylinderIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(triangleIndices.size()) && triangleIndices[i] >= 0.0f; i++) {
+            SimdFloat distances = simdSignedDistanceTriangle(points, broadcastTriangle(i));
+            keepClosest(distances, SimdFloat(triangleIndices[i]), ignored, closestDistances, closestIndices);
+        }
+    }
+
+    // The nearest function returns the closest
+    // shape to a point, running each kernel on
+    // SIMD_WIDTH shapes of one type at a time.
+    SceneHit nearest(const glm::vec3& point, int ignoredIndex) const {
+        globalThreadStats.sdfEvaluations += shapeCount;
+        SimdVec3 p(point);
+        SimdFloat ignored(static_cast<float>(ignoredIndex));
+        SimdFloat closestDistances(std::numeric_limits<float>::infinity());
+        SimdFloat closestIndices(std::numeric_limits<float>::infinity());
+
+        for (int i = 0; i < static_cast<int>(sphereIndices.size()); i += SIMD_WIDTH) {
+            SimdFloat distances = simdSignedDistanceSphere(p, sphereCenters.load(i), SimdFloat::load(&sphereRadii[i]));
+            keepClosest(distances, SimdFloat::load(&sphereIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(boxIndices.size()); i += SIMD_WIDTH) {
+            SimdFloat distances = simdSignedDistanceBox(p, boxCenters.load(i), SimdFloat::load(&boxHalfSizes[i]));
+            keepClosest(distances, SimdFloat::load(&boxIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(cylinderIndices.size()); i += SIMD_WIDTH) {
+            SimdFloat distances = simdSignedDistanceCylinder(p, cylinderCenters.load(i), SimdFloat::load(&cylinderRadii[i]),
+                                                             SimdFloat::load(&cylinderHalfHeights[i]));
+            keepClosest(distances, SimdFloat::load(&cylinderIndices[i]), ignored, closestDistances, closestIndices);
+        }
+        for (int i = 0; i < static_cast<int>(triangleIndices.size()); i += SIMD_WIDTH) {
+            SimdFloat distances = simdSignedDistanceTriangle(p, loadTriangles(i));
+            keepClosest(distances, SimdFloat::load(&triangleIndices[i]), ignored, closestDistances, closestIndices);
+        }
+
+        float laneDistances[SIMD_WIDTH];
+        float laneIndices[SIMD_WIDTH];
+        closestDistances.store(laneDistances);
+        closestIndices.store(laneIndices);
+
+        SceneHit closest = { std::numeric_limits<float>::infinity(), -1 };
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (laneIndices[lane] < 0.0f || laneIndices[lane] == std::numeric_limits<float>::infinity()) continue;
+
+            int index = static_cast<int>(laneIndices[lane]);
+            if (laneDistances[lane] < closest.distance || (laneDistances[lane] == closest.distance && index < closest.index)) {
+                closest.distance = laneDistances[lane];
+                closest.index = index;
+            }
+        }
+
+        return closest;
+    }
+};
+
+// The Scene struct holds the shapes read
+// from the scene file together with the
+// bounding volume hierarchy built over them,
+// the SIMD friendly copy of them, each
+// shape's bounds and the bounds of the
+// whole scene. build sets all of these up
+// once the shapes are read.
+
+struct Scene {
+    std::vector<Shape> shapes;
+    SdfBvh bvh;
+    SoaScene soa;
+    std::vector<glm::vec3> boundsMins;
+    std::vector<glm::vec3> boundsMaxs;
+    glm::vec3 sceneMin;
+    glm::vec3 sceneMax;
+
+    void build() {
+        bvh.build(shapes, globalRayCulling || globalTileCulling ? CULL_BVH_MIN_SHAPES : BVH_MIN_SHAPES);
+        soa.build(shapes);
+        boundsMins.resize(shapes.size());
+        boundsMaxs.resize(shapes.size());
+        sceneMin = glm::vec3(std::numeric_limits<float>::infinity());
+        sceneMax = glm::vec3(-std::numeric_limits<float>::infinity());
+        for (size_t i = 0; i < shapes.size(); i++) {
+            shapeBounds(shapes[i], boundsMins[i], boundsMaxs[i]);
+            sceneMin = glm::min(sceneMin, boundsMins[i]);
+            sceneMax = glm::max(sceneMax, boundsMaxs[i]);
+        }
+    }
+};
+
+// The sceneDistance function is the single
+// distance query used by the marching and
+// shadow loops. It returns the closest shape
+// to the given point, using the scene's
+// hierarchy when it has been built and
+// checking every shape otherwise, a whole
+// SIMD_WIDTH at a time when AVX2 is
+// available.
+// ignoredIndex lets shadow rays skip the
+// shape they start from.
+
+SceneHit sceneDistance(const glm::vec3& point, const Scene& scene, int ignoredIndex = -1) {
+    if (!scene.bvh.nodes.empty()) {
+        return scene.bvh.nearest(point, scene.shapes, ignoredIndex);
+    }
+
+#if defined(__AVX2__)
+    return scene.soa.nearest(point, ignoredIndex);
+#else
+    SceneHit closest = { std::numeric_limits<float>::infinity(), -1 };
+
+    for (int i = 0; i < static_cast<int>(scene.shapes.size()); i++) {
+        if (i == ignoredIndex) continue;
+
+        float dist = signedDistance(point, scene.shapes[i]);
+        if (dist < closest.distance) {
+            closest.distance = dist;
+            closest.index = i;
+        }
+    }
+
+    return closest;
+#endif
+}
+
+// The rayBoxInterval function is the slab
+// test for an axis aligned box. It finds the
+// stretch of the ray [entry, exit] that lies
+// inside the box and returns false if the
+// ray misses it. Axes the ray runs parallel
+// to are checked directly, so rays lying in
+// one of the box's faces don't turn into
+// 0 * infinity.
+
+bool rayBoxInterval(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const glm::vec3& boundsMin,
+                    const glm::vec3& boundsMax, float& entry, float& exit) {
+    entry = -std::numeric_limits<float>::infinity();
+    exit = std::numeric_limits<float>::infinity();
+
+    for (int axis = 0; axis < 3; axis++) {
+        if (rayDirection[axis] == 0.0f) {
+            if (rayOrigin[axis] < boundsMin[axis] || rayOrigin[axis] > boundsMax[axis]) return false;
+            continue;
+        }
+        float t1 = (boundsMin[axis] - rayOrigin[axis]) / rayDirection[axis];
+        float t2 = (boundsMax[axis] - rayOrigin[axis]) / rayDirection[axis];
+        entry = std::max(entry, std::min(t1, t2));
+        exit = std::min(exit, std::max(t1, t2));
+    }
+    return entry <= exit;
+}
+
+// A RayCandidate is a shape whose bounds a
+// ray passes through, and the stretch of the
+// ray [entry, exit] that lies inside them.
+
+struct RayCandidate {
+    float entry;
+    float exit;
+    int index;
+};
+
+// The RayCandidates struct is the list of
+// shapes a single ray could ever hit, used
+// by --cull. gather runs once per ray: it
+// clips the ray against every shape's
+// bounds, grown by delta so that a point
+// within delta of a shape is always inside
+// them, walking the hierarchy if the scene
+// has one, and sorts what it finds by entry
+// distance. After that, nearest only works
+// out the distances of the shapes whose
+// stretch covers the current point. A step
+// is never longer than the gap to the next
+// shape's entry, so the ray can't jump into
+// a shape it hasn't checked yet, and the
+// ray is done once every shape is behind
+// it. When a step is cut short like that,
+// the returned index is -1, since the
+// distance is a gap and not a shape's.
+// The results match sceneDistance wherever
+// a hit is possible, but rays take longer
+// steps past shapes they never touch, so
+// silhouettes can differ slightly.
+
+struct RayCandidates {
+    std::vector<RayCandidate> list;
+    size_t first = 0;
+
+    void gather(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, float maxDistance, const Scene& scene, int ignoredIndex) {
+        list.clear();
+        first = 0;
+        glm::vec3 margin(globalDelta);
+        float entry;
+        float exit;
+
+        auto consider = [&](int shapeIndex) {
+            if (shapeIndex == ignoredIndex) return;
+            if (rayBoxInterval(rayOrigin, rayDirection, scene.boundsMins[shapeIndex] - margin,
+                               scene.boundsMaxs[shapeIndex] + margin, entry, exit) &&
+                exit >= 0.0f && entry <= maxDistance) {
+                list.push_back({ std::max(entry, 0.0f), exit, shapeIndex });
+            }
+        };
+
+        if (scene.bvh.nodes.empty()) {
+            for (int i = 0; i < static_cast<int>(scene.shapes.size()); i++) {
+                consider(i);
+            }
+        } else {
+            int stack[64];
+            int stackSize = 0;
+
+            stack[stackSize++] = 0;
+            while (stackSize > 0) {
+                const BvhNode& node = scene.bvh.nodes[stack[--stackSize]];
+                if (!rayBoxInterval(rayOrigin, rayDirection, node.boundsMin - margin, node.boundsMax + margin, entry, exit) ||
+                    exit < 0.0f || entry > maxDistance) {
+                    continue;
+                }
+
+                if (node.shapeCount > 0) {
+                    for (int i = node.first; i < node.first + node.shapeCount; i++) {
+                        consider(scene.bvh.shapeIndices[i]);
+                    }
+                    continue;
+                }
+                stack[stackSize++] = node.first + 1;
+                stack[stackSize++] = node.first;
+            }
+        }
+
+        std::sort(list.begin(), list.end(), [](const RayCandidate& a, const RayCandidate& b) {
+            return a.entry < b.entry || (a.entry == b.entry && a.index < b.index);
+        });
+    }
+
+    SceneHit nearest(const glm::vec3& point, float t, const Scene& scene) {
+        while (first < list.size() && list[first].exit < t) first++;
+
+        SceneHit closest = { std::numeric_limits<float>::infinity(), -1 };
+        float nextEntry = std::numeric_limits<float>::infinity();
+
+        for (size_t i = first; i < list.size(); i++) {
+            const RayCandidate& candidate = list[i];
+            if (candidate.entry > t) {
+                nextEntry = candidate.entry;
+                break;
+            }
+            if (candidate.exit < t) continue;
+
+            float dist = signedDistance(point, scene.shapes[candidate.index]);
+            if (dist < closest.distance || (dist == closest.distance && candidate.index < closest.index)) {
+                closest.distance = dist;
+                closest.index = candidate.index;
+            }
+        }
+
+        if (closest.distance >= globalDelta && nextEntry - t < closest.distance) {
+            closest.distance = nextEntry - t;
+            closest.index = -1;
+        }
+        return closest;
+    }
+};
+
+// An Interval is a range [lo, hi] that a
+// value is known to lie in. The functions
+// below do arithmetic on whole ranges: each
+// result holds every value the operation
+// could give for any inputs in its ranges.
+// Running a signed distance function on
+// intervals instead of floats bounds its
+// value over a whole box of points at once.
+// An IntervalVec3 is such a box.
+
+struct Interval {
+    float lo;
+    float hi;
+};
+
+struct IntervalVec3 {
+    Interval x;
+    Interval y;
+    Interval z;
+};
+
+inline Interval interval(float value) {
+    return { value, value };
+}
+
+inline IntervalVec3 intervalBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+    return { { boundsMin.x, boundsMax.x }, { boundsMin.y, boundsMax.y }, { boundsMin.z, boundsMax.z } };
+}
+
+inline Interval operator+(Interval a, Interval b) {
+    return { a.lo + b.lo, a.hi + b.hi };
+}
+
+inline Interval operator-(Interval a, Interval b) {
+    return { a.lo - b.hi, a.hi - b.lo };
+}
+
+inline Interval operator*(Interval a, Interval b) {
+    float p1 = a.lo * b.lo;
+    float p2 = a.lo * b.hi;
+    float p3 = a.hi * b.lo;
+    float p4 = a.hi * b.hi;
+    return { std::min(std::min(p1, p2), std::min(p3, p4)), std::max(std::max(p1, p2), std::max(p3, p4)) };
+}
+
+inline IntervalVec3 operator-(const IntervalVec3& a, const IntervalVec3& b) {
+    return { a.x - b.x, a.y - b.y, a.z - b.z };
+}
+
+inline Interval intervalMin(Interval a, Interval b) {
+    return { std::min(a.lo, b.lo), std::min(a.hi, b.hi) };
+}
+
+inline Interval intervalMax(Interval a, Interval b) {
+    return { std::max(a.lo, b.lo), std::max(a.hi, b.hi) };
+}
+
+inline Interval intervalAbs(Interval a) {
+    if (a.lo >= 0.0f) return a;
+    if (a.hi <= 0.0f) return { -a.hi, -a.lo };
+    return { 0.0f, std::max(-a.lo, a.hi) };
+}
+
+inline Interval intervalSquare(Interval a) {
+    Interval magnitude = intervalAbs(a);
+    return { magnitude.lo * magnitude.lo, magnitude.hi * magnitude.hi };
+}
+
+inline Interval intervalLength(Interval x, Interval y) {
+    Interval squared = intervalSquare(x) + intervalSquare(y);
+    return { std::sqrt(squared.lo), std::sqrt(squared.hi) };
+}
+
+inline Interval intervalLength(const IntervalVec3& v) {
+    Interval squared = intervalSquare(v.x) + intervalSquare(v.y) + intervalSquare(v.z);
+    return { std::sqrt(squared.lo), std::sqrt(squared.hi) };
+}
+
+// These are the interval versions of the
+// signed distance functions, written out
+// the same way as the float ones. The
+// triangle's formula picks between two
+// cases by sign, which intervals can't
+// follow, so it is bounded instead by the
+// distance to its bounds from below and
+// the distance to a corner from above.
+
+Interval intervalDistanceSphere(const IntervalVec3& points, const Sphere& sphere) {
+    return intervalLength(points - intervalBox(sphere.center, sphere.center)) - interval(sphere.radius);
+}
+
+Interval intervalDistanceTriangle(const IntervalVec3& points, const Triangle& triangle) {
+    glm::vec3 boundsMin = glm::min(triangle.vertex1, glm::min(triangle.vertex2, triangle.vertex3));
+    glm::vec3 boundsMax = glm::max(triangle.vertex1, glm::max(triangle.vertex2, triangle.vertex3));
+    return { intervalLength(points - intervalBox(boundsMin, boundsMax)).lo,
+             intervalLength(points - intervalBox(triangle.vertex1, triangle.vertex1)).hi };
+}
+
+Interval intervalDistanceBox(const IntervalVec3& points, const Box& box) {
+    Interval halfSize = interval(0.5f * box.size);
+    Interval zero = interval(0.0f);
+    Interval qx = intervalAbs(points.x - interval(box.center.x)) - halfSize;
+    Interval qy = intervalAbs(points.y - interval(box.center.y)) - halfSize;
+    Interval qz = intervalAbs(points.z - interval(box.center.z)) - halfSize;
+    IntervalVec3 outside = { intervalMax(qx, zero), intervalMax(qy, zero), intervalMax(qz, zero) };
+    return intervalLength(outside) + intervalMin(intervalMax(qx, intervalMax(qy, qz)), zero);
+}
+
+Interval intervalDistanceCylinder(const IntervalVec3& points, const Cylinder& cylinder) {
+    Interval zero = interval(0.0f);
+    Interval dx = intervalLength(points.x - interval(cylinder.center.x), points.z - interval(cylinder.center.z)) - interval(cylinder.rad);
+    Interval dy = intervalAbs(points.y - interval(cylinder.center.y)) - interval(cylinder.h * 0.5f);
+    return intervalLength(intervalMax(dx, zero), intervalMax(dy, zero)) + intervalMin(intervalMax(dx, dy), zero);
+}
+
+Interval intervalSignedDistance(const IntervalVec3& points, const Shape& shape) {
+    if (shape.type == Shape::SPHERE) {
+        return intervalDistanceSphere(points, shape.sphere);
+    } else if (shape.type == Shape::TRIANGLE) {
+        return intervalDistanceTriangle(points, shape.triangle);
+    } else if (shape.type == Shape::BOX) {
+        return intervalDistanceBox(points, shape.box);
+    } else if (shape.type == Shape::CYLINDER) {
+        return intervalDistanceCylinder(points, shape.cylinder);
+    }
+    return interval(std::numeric_limits<float>::infinity());
+}
+
+// The TileCulling struct works out, for one
+// tile of the image, which shapes its camera
+// rays can need at each depth, used by
+// --tile-cull. build takes the depths at
+// which the tile's rays can be inside the
+// scene's bounds and splits them into
+// TILE_CULL_SLABS slabs. The part of a slab
+// the tile's rays sweep through is bounded
+// by a box, found with interval arithmetic
+// from the tile's corner rays, and every
+// shape's distance over that box is bounded
+// by its interval function. A shape whose
+// smallest possible distance is larger
+// than some other shape's largest can never
+// be the closest one inside the box, so it
+// is dropped from the slab's list. If no
+// shape can come within hitEpsilon at all,
+// the slab is empty and enterSlab moves
+// rays straight past it. Inside a slab,
+// nearest gives the same distances as
+// sceneDistance while asking far fewer
+// shapes.
+
+struct TileCulling {
+    float nearDepth = 0.0f;
+    float slabDepth = 0.0f;
+    std::vector<int> slabFirst;
+    std::vector<int> shapeIndices;
+    std::vector<std::pair<float, int>> found;
+
+    // Returns false when the tile's rays can't
+    // be bounded, and they have to be marched
+    // against the whole scene.
+    bool build(const Scene& scene, const Camera& camera, int startX, int startY, int endX, int endY) {
+        slabFirst.assign(1, 0);
+        shapeIndices.clear();
+        if (scene.shapes.empty()) return false;
+
+        // Pixel points are spaced evenly, so the
+        // corners bound the whole tile.
+        glm::vec3 corner1 = camera.pixelPoint(startX, startY);
+        glm::vec3 corner2 = camera.pixelPoint(endX - 1, endY - 1);
+        glm::vec3 corner3 = camera.pixelPoint(endX - 1, startY);
+        glm::vec3 corner4 = camera.pixelPoint(startX, endY - 1);
+        IntervalVec3 points = intervalBox(glm::min(glm::min(corner1, corner2), glm::min(corner3, corner4)),
+                                          glm::max(glm::max(corner1, corner2), glm::max(corner3, corner4)));
+
+        IntervalVec3 origins;
+        IntervalVec3 directions;
+        if (camera.projection == Camera::PERSPECTIVE) {
+            Interval length = intervalLength(points);
+            if (length.lo <= 0.0f) return false;
+
+            Interval inverse = { -1.0f / length.lo, -1.0f / length.hi };
+            origins = intervalBox(camera.position, camera.position);
+            directions = { points.x * inverse, points.y * inverse, points.z * inverse };
+        } else {
+            origins = points;
+            directions = intervalBox(camera.forward, camera.forward);
+        }
+
+        glm::vec3 margin(hitEpsilon(static_cast<float>(globalMaxDistance)));
+        Interval depths = intervalLength(intervalBox(scene.sceneMin - margin, scene.sceneMax + margin) - origins);
+        float farDepth = std::min(depths.hi, static_cast<float>(globalMaxDistance));
+        nearDepth = depths.lo;
+        slabDepth = (farDepth - nearDepth) / TILE_CULL_SLABS;
+        if (slabDepth <= 0.0f) return true;
+
+        // Regions are grown by delta, so rounding
+        // can't leave a ray's point outside them.
+        Interval grow = { -globalDelta, globalDelta };
+        for (int slab = 0; slab < TILE_CULL_SLABS; slab++) {
+            Interval slabDepths = { nearDepth + slab * slabDepth, nearDepth + (slab + 1) * slabDepth };
+            IntervalVec3 region = { origins.x + slabDepths * directions.x + grow,
+                                    origins.y + slabDepths * directions.y + grow,
+                                    origins.z + slabDepths * directions.z + grow };
+            gatherSlab(region, scene, hitEpsilon(slabDepths.hi));
+            slabFirst.push_back(static_cast<int>(shapeIndices.size()));
+        }
+        return true;
+    }
+
+    // Adds the shapes that can be closest
+    // somewhere in region to shapeIndices,
+    // or none if none can come within
+    // hitDistance there.
+    // The hierarchy is walked nearest box
+    // first, as in SdfBvh::nearest, skipping
+    // boxes that are further away than the
+    // best largest distance found so far.
+    void gatherSlab(const IntervalVec3& region, const Scene& scene, float hitDistance) {
+        float bestHi = std::numeric_limits<float>::infinity();
+        found.clear();
+
+        auto consider = [&](int shapeIndex) {
+            Interval dist = intervalSignedDistance(region, scene.shapes[shapeIndex]);
+            if (dist.lo <= bestHi) found.push_back({ dist.lo, shapeIndex });
+            bestHi = std::min(bestHi, dist.hi);
+        };
+
+        if (scene.bvh.nodes.empty()) {
+            for (int i = 0; i < static_cast<int>(scene.shapes.size()); i++) {
+                consider(i);
+            }
+        } else {
+            const std::vector<BvhNode>& nodes = scene.bvh.nodes;
+            int stackNodes[64];
+            float stackDistances[64];
+            int stackSize = 0;
+
+            stackNodes[stackSize] = 0;
+            stackDistances[stackSize++] = intervalLength(region - intervalBox(nodes[0].boundsMin, nodes[0].boundsMax)).lo;
+
+            while (stackSize > 0) {
+                stackSize--;
+                const BvhNode& node = nodes[stackNodes[stackSize]];
+                float nodeDistance = stackDistances[stackSize];
+                if (nodeDistance > 0.0f && nodeDistance > bestHi) continue;
+
+                if (node.shapeCount > 0) {
+                    for (int i = node.first; i < node.first + node.shapeCount; i++) {
+                        consider(scene.bvh.shapeIndices[i]);
+                    }
+                    continue;
+                }
+
+                float leftDistance = intervalLength(region - intervalBox(nodes[node.first].boundsMin, nodes[node.first].boundsMax)).lo;
+                float rightDistance = intervalLength(region - intervalBox(nodes[node.first + 1].boundsMin, nodes[node.first + 1].boundsMax)).lo;
+                int nearChild = leftDistance <= rightDistance ? node.first : node.first + 1;
+
+                stackNodes[stackSize] = nearChild == node.first ? node.first + 1 : node.first;
+                stackDistances[stackSize++] = std::max(leftDistance, rightDistance);
+                stackNodes[stackSize] = nearChild;
+                stackDistances[stackSize++] = std::min(leftDistance, rightDistance);
+            }
+        }
+
+        // Only shapes that can still be closest
+        // are kept, sorted into scene order so
+        // ties go the same way as in sceneDistance.
+        size_t first = shapeIndices.size();
+        float bestLo = std::numeric_limits<float>::infinity();
+        for (const auto& shape : found) {
+            if (shape.first > bestHi) continue;
+            shapeIndices.push_back(shape.second);
+            bestLo = std::min(bestLo, shape.first);
+        }
+        if (bestLo >= hitDistance) {
+            shapeIndices.resize(first);
+        } else {
+            std::sort(shapeIndices.begin() + first, shapeIndices.end());
+        }
+    }
+
+    // Moves depth forward past any empty slabs
+    // and returns the slab it ends up in, or
+    // -1 if the ray has left the scene.
+    int enterSlab(float& depth) const {
+        int slabCount = static_cast<int>(slabFirst.size()) - 1;
+        if (slabCount == 0) return -1;
+        if (depth < nearDepth) depth = nearDepth;
+
+        int slab = std::min(static_cast<int>((depth - nearDepth) / slabDepth), slabCount);
+        while (slab < slabCount && slabFirst[slab] == slabFirst[slab + 1]) {
+            slab++;
+            depth = std::max(depth, nearDepth + slab * slabDepth);
+        }
+        return slab < slabCount ? slab : -1;
+    }
+
+    SceneHit nearest(const glm::vec3& point, int slab, const Scene& scene) const {
+        SceneHit closest = { std::numeric_limits<float>::infinity(), -1 };
+
+        for (int i = slabFirst[slab]; i < slabFirst[slab + 1]; i++) {
+            int shapeIndex = shapeIndices[i];
+            float dist = signedDistance(point, scene.shapes[shapeIndex]);
+            if (dist < closest.distance) {
+                closest.distance = dist;
+                closest.index = shapeIndex;
+            }
+        }
+        return closest;
+    }
+};
+
+// The shadowVisibility function sphere
+// traces a shadow ray from a surface point
+// towards the light. Instead of creeping
+// forward by delta, every step moves as far
+// as the closest other shape allows, which
+// can never skip over a surface. It returns
+// 0 for a blocked light and 1 for a clear
+// one. If soft_shadows is set in the scene
+// file, rays that pass close to a blocker
+// also return a value in between, which
+// gives the shadow a penumbra for free.
+// With --cull, hard shadow rays only look
+// at the shapes they pass through. Soft
+// shadows need the distance to every shape
+// nearby, so they are never culled.
+
+float shadowVisibility(const glm::vec3& surfacePoint, const glm::vec3& lightPosition, const Scene& scene, int ignoredIndex) {
+    glm::vec3 shadowRayDirection = glm::normalize(lightPosition - surfacePoint);
+    float shadowRayDistance = glm::length(lightPosition - surfacePoint);
+    float visibility = 1.0f;
+    float t = globalDelta;
+
+    // Kept between rays so its list isn't
+    // allocated again for every ray.
+    static thread_local RayCandidates candidates;
+    bool culled = globalRayCulling && globalShadowSoftness <= 0.0f;
+    if (culled) {
+        candidates.gather(surfacePoint, shadowRayDirection, shadowRayDistance, scene, ignoredIndex);
+    }
+
+    globalThreadStats.shadowRays++;
+    for (int step = 0; step < globalMaxShadowSteps && t < shadowRayDistance; step++) {
+        globalThreadStats.shadowSteps++;
+        glm::vec3 shadowRayOrigin = surfacePoint + t * shadowRayDirection;
+        SceneHit closest = culled ? candidates.nearest(shadowRayOrigin, t, scene) : sceneDistance(shadowRayOrigin, scene, ignoredIndex);
+
+        if (closest.index >= 0 && closest.distance < globalDelta) {
+            return 0.0f;
+        }
+        if (globalShadowSoftness > 0.0f) {
+            visibility = glm::min(visibility, globalShadowSoftness * closest.distance / t);
+        }
+        t += closest.distance;
+    }
+
+    return visibility;
+}
+
+// The readSetupFile function takes in a
+// file from the user and crafts a scene
+// from its specifications. It goes down
+// every line in the file and performs
+// certain functions based on the given
+// commands. It returns false if the file
+// can't be opened.
+
+bool readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
+    std::ifstream file(filename);
+
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not open the setup file " << filename << ".\n";
+        return false;
+    }
+
+    std::string line;
+    std::map<std::string, int> objectIndices;
+
+    while (std::getline(file, line)) {
+        std::istringstream iss(line);
+        std::string command;
+        iss >> command;
+
+        if (command == "image") {
+            iss >> globalWidth >> globalHeight;
+        }
+        else if (command == "camera_position") {
+            glm::vec3 position;
+            iss >> position.x >> position.y >> position.z;
+            globalCameraPosition = position;
+        }
+        else if (command == "camera_target") {
+            glm::vec3 target;
+            iss >> target.x >> target.y >> target.z;
+            globalCameraTarget = target;
+        }
+        else if (command == "camera_up") {
+            glm::vec3 up;
+            iss >> up.x >> up.y >> up.z;
+            globalCameraUp = up;
+        }
+        else if (command == "camera_projection") {
+            std::string projection;
+            iss >> projection;
+            globalCameraOrthographic = (projection == "orthographic");
+            if (globalCameraOrthographic && !(iss >> globalCameraOrthoHalfHeight)) {
+                globalCameraOrthoHalfHeight = 1.0f;
+            }
+        }
+        else if (command == "soft_shadows") {
+            iss >> globalShadowSoftness;
+        }
+        else if (command == "pixel_epsilon") {
+            iss >> globalPixelEpsilon;
+        }
+        else if (command == "relaxation") {
+            iss >> globalRelaxation;
+            globalRelaxation = glm::clamp(globalRelaxation, 1.0f, 1.99f);
+        }
+        else if (command == "sphere") {
+            Sphere sphere;
+            iss >> sphere.center.x >> sphere.center.y >> sphere.center.z >> sphere.radius >> sphere.color.r >> sphere.color.g >> sphere.color.b;
+            Shape shape(Shape::SPHERE);
+            shape.setSphere(sphere);
+            shape.applyTransform(glm::mat4(1.0f));
+            scene.emplace_back(shape);
+        }
+        else if (command == "triangle") {
+            Triangle triangle;
+            iss >> triangle.vertex1.x >> triangle.vertex1.y >> triangle.vertex1.z
+                >> triangle.vertex2.x >> triangle.vertex2.y >> triangle.vertex2.z
+                >> triangle.vertex3.x >> triangle.vertex3.y >> triangle.vertex3.z
+                >> triangle.color.r >> triangle.color.g >> triangle.color.b;
+            Shape shape(Shape::TRIANGLE);
+            shape.setTriangle(triangle);
+            shape.applyTransform(glm::mat4(1.0f));
+            scene.emplace_back(shape);
+        }
+        else if (command == "box") {
+            Box box;
+            iss >> box.center.x >> box.center.y >> box.center.z >> box.size >> box.color.r >> box.color.g >> box.color.b;
+            Shape shape(Shape::BOX);
+            shape.setBox(box);
+            shape.applyTransform(glm::mat4(1.0f));
+            scene.emplace_back(shape);
+        }
+        else if (command == "cylinder") {
+            Cylinder cylinder;
+            iss >> cylinder.center.x >> cylinder.center.y >> cylinder.center.z >> cylinder.rad >> cylinder.h >> cylinder.color.r >> cylinder.color.g >> cylinder.color.b;
+            Shape shape(Shape::CYLINDER);
+            shape.setCylinder(cylinder);
+            shape.applyTransform(glm::mat4(1.0f));
+            scene.emplace_back(shape);
+        }
+        else if (command == "name") {
+            std::string objectName;
+            iss >> objectName;
+            objectIndices[objectName] = static_cast<int>(scene.size()) - 1;
+        }
+        else if (command == "parent") { // Vestigial Code
+            std::string parentName;
+            iss >> parentName;
+            int childIndex = static_cast<int>(scene.size()) - 1;
+
+            if (objectIndices.find(parentName) != objectIndices.end()) {
+                int parentIndex = objectIndices[parentName];
+                glm::mat4 currentTransform = scene[childIndex].getTransform();
+                scene[childIndex].applyTransform(currentTransform);
+                scene[parentIndex].children.push_back(childIndex);
+            }
+        }
+        else if (command == "transform") { // Vestigial Code
+            glm::mat4 transformMatrix = glm::mat4(1.0f);
+
+            for (int i = 0; i < 4; i++) {
+                for (int j = 0; j < 4; j++) {
+                    iss >> transformMatrix[j][i];
+                }
+            }
+
+            scene.back().applyTransform(transformMatrix);
+        }
+    }
+
+    return true;
+}
+
+
+// The lightPoint function runs the lighting
+// calculations for a point on the surface
+// of the shape that a ray marched into,
+// given how much of the light reaches it.
+
+glm::vec3 lightPoint(const glm::vec3& hitPoint, const glm::vec3& rayDirection, int shapeIndex, const Scene& scene, float lightVisibility) {
+    using namespace glm;
+    const Shape& shape = scene.shapes[shapeIndex];
+    vec3 normalVector;
+    vec3 ambientColor = vec3(0.1f, 0.1f, 0.1f);
+    vec3 lightPosition = globalLightPosition;
+    vec3 lightDirection = normalize(lightPosition - hitPoint);
+
+    if (shape.type == Shape::SPHERE) {
+        normalVector = normalize(hitPoint - shape.sphere.center);
+    }
+    else if (shape.type == Shape::TRIANGLE) {
+        vec3 edge1 = shape.triangle.vertex2 - shape.triangle.vertex1;
+        vec3 edge2 = shape.triangle.vertex3 - shape.triangle.vertex1;
+
+        normalVector = -normalize(cross(edge1, edge2));
+    }
+    else if (shape.type == Shape::BOX) {
+        normalVector = normalize(hitPoint - shape.box.center);
+        float maxComponent = max(abs(normalVector.x), max(abs(normalVector.y), abs(normalVector.z)));
+
+        if (abs(maxComponent - abs(normalVector.x)) < EPSILON) {
+            normalVector.x = glm::sign(normalVector.x);
+            normalVector.y = normalVector.z = 0.0f;
+        } else if (abs(maxComponent - abs(normalVector.y)) < EPSILON) {
+            normalVector.y = glm::sign(normalVector.y);
+            normalVector.x = normalVector.z = 0.0f;
+        } else if (abs(maxComponent - abs(normalVector.z)) < EPSILON) {
+            normalVector.z = glm::sign(normalVector.z);
+            normalVector.x = normalVector.y = 0.0f;
+        }
+
+    }
+    else if (shape.type == Shape::CYLINDER) {
+        vec2 d = abs(vec2(length(vec2(hitPoint.x, hitPoint.z) - vec2(shape.cylinder.center.x, shape.cylinder.center.z)), hitPoint.y - shape.cylinder.center.y)) - vec2(shape.cylinder.rad, shape.cylinder.h * 0.5f);
+
+        if (length(d) < EPSILON) {
+            normalVector = normalize(vec3(0.0f, glm::sign(hitPoint.y - shape.cylinder.center.y), 0.0f));
+        } else {
+            normalVector = normalize(vec3(hitPoint.x - shape.cylinder.center.x, 0.0f, hitPoint.z - shape.cylinder.center.z));
+        }
+    }
+
+    // More Lighting Calculations
+    float diffuseIntensity = glm::max(0.0f, dot(normalVector, lightDirection));
+
+    // Diffuse Lighting Calculations
+    vec3 diffuseColor = shape.color;
+    vec3 lightColor = vec3(1.0f, 1.0f, 1.0f);
+
+    // Specular Lighting Calculations
+    float shininess = 10.0f;
+    vec3 viewDirection = -rayDirection;
+    vec3 reflectionDirection = reflect(-lightDirection, normalVector);
+    float specularIntensity = pow(max(0.0f, dot(viewDirection, reflectionDirection)), shininess);
+    vec3 specularColor = vec3(0.5f, 0.5f, 0.5f);
+
+    // Color Formula
+    vec3 color = glm::clamp(ambientColor + diffuseIntensity * diffuseColor * lightColor + specularIntensity * specularColor, 0.0f, 1.0f);
+    if (lightVisibility < 1.0f) color = color * mix(0.2f, 1.0f, lightVisibility);
+
+    return color;
+}
+
+// The shadePoint function shades one point
+// on its own, tracing its shadow ray first.
+// It is called once per pixel, after the
+// marching loop has found the closest shape.
+
+glm::vec3 shadePoint(const glm::vec3& hitPoint, const glm::vec3& rayDirection, int shapeIndex, const Scene& scene) {
+    double shadowStart = statsClock();
+    float lightVisibility = shadowVisibility(hitPoint, globalLightPosition, scene, shapeIndex);
+    double shadingStart = statsClock();
+    glm::vec3 color = lightPoint(hitPoint, rayDirection, shapeIndex, scene, lightVisibility);
+    globalThreadStats.shadowSeconds += shadingStart - shadowStart;
+    globalThreadStats.shadingSeconds += statsClock() - shadingStart;
+    return color;
+}
+
+// The coneDepth function marches a cone
+// instead of a ray. The cone holds the rays
+// of every pixel in the block from
+// (startX, startY) to (endX, endY), both
+// included. At depth t each of those rays
+// is at most radius(t) from the cone's
+// center ray, so no shape can be closer to
+// any of them than the center's distance
+// minus radius(t). Stepping by that much,
+// less hitEpsilon, skips the same empty
+// space for every ray in the block at
+// once. The march stops once a step would
+// be shorter than the cone is wide, and
+// returns the depth every ray in the block
+// can safely start from.
+
+float coneDepth(const Scene& scene, const Camera& camera, int startX, int startY, int endX, int endY, float start) {
+    glm::vec3 corners[4] = { camera.pixelPoint(startX, startY), camera.pixelPoint(endX, startY),
+                             camera.pixelPoint(startX, endY), camera.pixelPoint(endX, endY) };
+    glm::vec3 center = 0.25f * (corners[0] + corners[1] + corners[2] + corners[3]);
+    glm::vec3 origin = camera.rayOrigin(center);
+    glm::vec3 direction = camera.rayDirection(center);
+
+    // radius(t) is offset + t * spread. The
+    // corner rays are the furthest from the
+    // center ray in both.
+    float offset = 0.0f;
+    float spread = 0.0f;
+    for (const glm::vec3& corner : corners) {
+        offset = std::max(offset, glm::length(camera.rayOrigin(corner) - origin));
+        spread = std::max(spread, glm::length(camera.rayDirection(corner) - direction));
+    }
+
+    float depth = start;
+    for (int step = 0; step < globalMaxIterations && depth < globalMaxDistance; step++) {
+        globalThreadStats.coneSteps++;
+        float radius = offset + depth * spread;
+        float distance = sceneDistance(origin + depth * direction, scene).distance;
+        float clear = distance - radius - hitEpsilon(depth + distance);
+        if (clear < std::max(radius, globalDelta)) break;
+        depth += clear;
+    }
+    return std::min(depth, static_cast<float>(globalMaxDistance));
+}
+
+// The coneStartDepths function runs the
+// --cones pre-pass over one tile. A cone
+// over each CONE_BLOCK_SIZE block goes as
+// far as it safely can, cones over the
+// CONE_FINE_BLOCK_SIZE blocks inside it
+// carry on from there, and every pixel's
+// ray starts where its small block's cone
+// stopped. depths gets one start depth per
+// pixel of the tile, row by row.
+
+void coneStartDepths(const Scene& scene, const Camera& camera, int startX, int startY, int endX, int endY,
+                     std::vector<float>& depths) {
+    int tileWidth = endX - startX;
+    depths.assign(tileWidth * (endY - startY), 0.0f);
+
+    for (int blockY = startY; blockY < endY; blockY += CONE_BLOCK_SIZE) {
+        for (int blockX = startX; blockX < endX; blockX += CONE_BLOCK_SIZE) {
+            int blockEndX = std::min(blockX + CONE_BLOCK_SIZE, endX);
+            int blockEndY = std::min(blockY + CONE_BLOCK_SIZE, endY);
+            float blockDepth = coneDepth(scene, camera, blockX, blockY, blockEndX - 1, blockEndY - 1, 0.0f);
+
+            for (int y = blockY; y < blockEndY; y += CONE_FINE_BLOCK_SIZE) {
+                for (int x = blockX; x < blockEndX; x += CONE_FINE_BLOCK_SIZE) {
+                    int fineEndX = std::min(x + CONE_FINE_BLOCK_SIZE, blockEndX);
+                    int fineEndY = std::min(y + CONE_FINE_BLOCK_SIZE, blockEndY);
+                    float depth = coneDepth(scene, camera, x, y, fineEndX - 1, fineEndY - 1, blockDepth);
+
+                    for (int pixelY = y; pixelY < fineEndY; pixelY++) {
+                        for (int pixelX = x; pixelX < fineEndX; pixelX++) {
+                            depths[(pixelY - startY) * tileWidth + (pixelX - startX)] = depth;
+                        }
+                    }
+                }
+            }
+        }
+    }
+}
+
+// The marchRay function sphere traces a
+// single camera ray and returns its color.
+// Every step asks sceneDistance for the
+// distance to the closest shape at the
+// current point and moves that far along
+// the ray, since nothing can be closer. Once
+// that distance drops below hitEpsilon, the
+// ray has hit that shape and it gets
+// shaded. It only reads from the scene, so
+// any number of threads can call it at the
+// same time.
+// With --cull, each ray first gathers the
+// shapes it passes through and only asks
+// those for their distances. With
+// --tile-cull, tiles gives the shapes its
+// tile's rays can need at each depth. With
+// --cones, the ray starts at startDepth.
+//
+// relaxation factor
+//
+// in the scene file turns on over-relaxed
+// steps: each step is the distance times
+// factor (between 1 and 2), which gets
+// along flat surfaces the ray runs beside
+// much faster. A step that long can jump
+// past a surface, so after each one the
+// ray checks that the distance spheres
+// around this point and the last one still
+// overlap. If they don't, part of the ray
+// between them was never checked, and it
+// goes back to take a plain step from the
+// last point instead. That step is safe,
+// so the point it reaches isn't checked
+// again. --cull only knows distances along
+// the ray, not in every direction, so
+// culled rays never relax. With --tile-cull
+// the ray can also skip ahead past empty
+// slabs, and the overlap check starts over
+// from wherever it lands.
+
+glm::vec3 marchRay(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const Scene& scene,
+                   float startDepth = 0.0f, const TileCulling* tiles = nullptr) {
+    float distTraveled = startDepth;
+    double marchStart = statsClock();
+
+    // Kept between rays so its list isn't
+    // allocated again for every ray.
+    static thread_local RayCandidates candidates;
+    if (globalRayCulling && !tiles) {
+        candidates.gather(rayOrigin, rayDirection, static_cast<float>(globalMaxDistance), scene, -1);
+    }
+
+    float relaxation = globalRayCulling && !tiles ? 1.0f : globalRelaxation;
+    float previousDepth = distTraveled;
+    float previousDistance = std::numeric_limits<float>::infinity();
+
+    globalThreadStats.cameraRays++;
+    for (int iterations = 0; iterations < globalMaxIterations && distTraveled < globalMaxDistance; iterations++) {
+        globalThreadStats.marchSteps++;
+        int slab = -1;
+        if (tiles) {
+            float depth = distTraveled;
+            slab = tiles->enterSlab(distTraveled);
+            if (slab < 0 || distTraveled >= globalMaxDistance) break;
+            if (distTraveled != depth) {
+                if (previousDistance < std::numeric_limits<float>::infinity()) globalThreadStats.relaxedSteps++;
+                previousDepth = distTraveled;
+                previousDistance = std::numeric_limits<float>::infinity();
+            }
+        }
+
+        glm::vec3 currentCoords = rayOrigin + (distTraveled * rayDirection);
+        SceneHit closest;
+        if (tiles) {
+            closest = tiles->nearest(currentCoords, slab, scene);
+        } else if (globalRayCulling) {
+            closest = candidates.nearest(currentCoords, distTraveled, scene);
+        } else {
+            closest = sceneDistance(currentCoords, scene);
+        }
+
+        // Only an empty scene, or a culled ray
+        // with every shape behind it, has
+        // nothing left to step towards.
+        if (closest.distance == std::numeric_limits<float>::infinity()) break;
+
+        // A distance clamped to the next culled
+        // shape (index -1) isn't a sphere around
+        // the point, so it's neither checked
+        // nor relaxed.
+        bool bounded = closest.index >= 0;
+        if (relaxation > 1.0f && bounded && std::abs(closest.distance) + previousDistance < distTraveled - previousDepth) {
+            globalThreadStats.backtracks++;
+            distTraveled = previousDepth + previousDistance;
+            previousDistance = std::numeric_limits<float>::infinity();
+            continue;
+        }
+        if (relaxation > 1.0f && bounded && previousDistance < std::numeric_limits<float>::infinity()) globalThreadStats.relaxedSteps++;
+        if (closest.index >= 0 && closest.distance < hitEpsilon(distTraveled)) {
+            globalThreadStats.hits++;
+            globalThreadStats.marchSeconds += statsClock() - marchStart;
+            return shadePoint(currentCoords, rayDirection, closest.index, scene);
+        }
+        previousDepth = distTraveled;
+        previousDistance = bounded ? std::abs(closest.distance) : std::numeric_limits<float>::infinity();
+        distTraveled += (bounded ? relaxation : 1.0f) * closest.distance;
+    }
+
+    globalThreadStats.marchSeconds += statsClock() - marchStart;
+    return glm::vec3(0.0f, 0.0f, 0.0f);
+}
+
+// A PacketRay is one ray waiting to be
+// marched by marchPackets: where it starts,
+// which way it goes, where along it to
+// start and stop, and which shape it should
+// not see (-1 for none). A PacketResult is
+// what became of it: the distance and shape
+// it hit (index -1 if it hit nothing), how
+// many steps and shape distances it took
+// and, for shadow rays, how much light got
+// past.
+
+struct PacketRay {
+    glm::vec3 origin;
+    glm::vec3 direction;
+    float start;
+    float maxDistance;
+    int maxSteps;
+    int ignoredIndex;
+};
+
+struct PacketResult {
+    float distance;
+    int index;
+    float visibility;
+    int steps;
+    int evaluations;
+};
+
+// The packetDistance function finds the
+// closest shape to the point in every lane.
+// Small scenes run the packet kernels, while
+// scenes with a hierarchy search it once per
+// active lane. The number of shape distances
+// worked out for each lane is added to
+// evaluations.
+
+void packetDistance(const SimdVec3& points, SimdFloat ignored, int activeLanes, const Scene& scene,
+                    SimdFloat& closestDistances, SimdFloat& closestIndices, int* evaluations) {
+    if (scene.bvh.nodes.empty()) {
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (activeLanes & (1 << lane)) evaluations[lane] += scene.soa.shapeCount;
+        }
+        globalThreadStats.sdfEvaluations += static_cast<long long>(scene.soa.shapeCount) * std::bitset<32>(activeLanes).count();
+        scene.soa.nearestPacket(points, ignored, closestDistances, closestIndices);
+        return;
+    }
+
+    float x[SIMD_WIDTH], y[SIMD_WIDTH], z[SIMD_WIDTH], ignoredIndices[SIMD_WIDTH];
+    float distances[SIMD_WIDTH], indices[SIMD_WIDTH];
+    points.x.store(x);
+    points.y.store(y);
+    points.z.store(z);
+    ignored.store(ignoredIndices);
+
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        distances[lane] = std::numeric_limits<float>::infinity();
+        indices[lane] = -1.0f;
+        if (!(activeLanes & (1 << lane))) continue;
+
+        long long evaluationsBefore = globalThreadStats.sdfEvaluations;
+        SceneHit closest = scene.bvh.nearest(glm::vec3(x[lane], y[lane], z[lane]), scene.shapes,
+                                             static_cast<int>(ignoredIndices[lane]));
+        evaluations[lane] += static_cast<int>(globalThreadStats.sdfEvaluations - evaluationsBefore);
+        distances[lane] = closest.distance;
+        indices[lane] = static_cast<float>(closest.index);
+    }
+
+    closestDistances = SimdFloat::load(distances);
+    closestIndices = SimdFloat::load(indices);
+}
+
+// The marchPackets function sphere traces a
+// list of rays SIMD_WIDTH at a time, one ray
+// per lane, all moving in lockstep. It takes
+// the same steps as marchRay and
+// shadowVisibility would for each ray on its
+// own. A lane is done once its ray hits a
+// shape, runs out of steps or goes past its
+// maximum distance, and is then refilled
+// with the next waiting ray, so the lanes
+// stay busy until the list runs dry. Passing
+// a softness above 0 tracks soft shadow
+// visibility the same way shadowVisibility
+// does, and a relaxation above 1 takes
+// over-relaxed steps, backtracking the same
+// way marchRay does. Camera rays pass
+// cameraRays so that they stop at
+// hitEpsilon rather than delta.
+
+void marchPackets(const std::vector<PacketRay>& rays, std::vector<PacketResult>& results, const Scene& scene, float softness,
+                  float relaxation = 1.0f, bool cameraRays = false) {
+    float originX[SIMD_WIDTH], originY[SIMD_WIDTH], originZ[SIMD_WIDTH];
+    float directionX[SIMD_WIDTH], directionY[SIMD_WIDTH], directionZ[SIMD_WIDTH];
+    float distance[SIMD_WIDTH], maxDistance[SIMD_WIDTH], ignored[SIMD_WIDTH], visibility[SIMD_WIDTH];
+    float closest[SIMD_WIDTH], closestIndex[SIMD_WIDTH];
+    float previousDepth[SIMD_WIDTH], previousDistance[SIMD_WIDTH];
+    int steps[SIMD_WIDTH], maxSteps[SIMD_WIDTH], evaluations[SIMD_WIDTH], laneRay[SIMD_WIDTH];
+    int nextRay = 0;
+    int activeLanes = 0;
+
+    results.resize(rays.size());
+
+    // Rays that would not take a single step
+    // are answered straight away.
+    auto refill = [&](int lane) {
+        while (nextRay < static_cast<int>(rays.size())) {
+            const PacketRay& ray = rays[nextRay];
+            int rayIndex = nextRay++;
+
+            if (ray.maxSteps <= 0 || !(ray.start < ray.maxDistance)) {
+                results[rayIndex] = { ray.start, -1, 1.0f, 0, 0 };
+                continue;
+            }
+
+            originX[lane] = ray.origin.x;
+            originY[lane] = ray.origin.y;
+            originZ[lane] = ray.origin.z;
+            directionX[lane] = ray.direction.x;
+            directionY[lane] = ray.direction.y;
+            directionZ[lane] = ray.direction.z;
+            distance[lane] = ray.start;
+            previousDepth[lane] = ray.start;
+            previousDistance[lane] = std::numeric_limits<float>::infinity();
+            maxDistance[lane] = ray.maxDistance;
+            ignored[lane] = static_cast<float>(ray.ignoredIndex);
+            visibility[lane] = 1.0f;
+            steps[lane] = 0;
+            evaluations[lane] = 0;
+            maxSteps[lane] = ray.maxSteps;
+            laneRay[lane] = rayIndex;
+            activeLanes |= 1 << lane;
+            return;
+        }
+
+        // An empty lane keeps marching a harmless
+        // ray whose result is never read.
+        originX[lane] = originY[lane] = originZ[lane] = 0.0f;
+        directionX[lane] = directionY[lane] = directionZ[lane] = 0.0f;
+        distance[lane] = 1.0f;
+        previousDepth[lane] = 1.0f;
+        previousDistance[lane] = std::numeric_limits<float>::infinity();
+        ignored[lane] = -1.0f;
+        visibility[lane] = 1.0f;
+        laneRay[lane] = -1;
+        activeLanes &= ~(1 << lane);
+    };
+
+    for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+        refill(lane);
+    }
+
+    while (activeLanes != 0) {
+        SimdFloat t = SimdFloat::load(distance);
+        SimdVec3 points(SimdFloat::load(originX) + t * SimdFloat::load(directionX),
+                        SimdFloat::load(originY) + t * SimdFloat::load(directionY),
+                        SimdFloat::load(originZ) + t * SimdFloat::load(directionZ));
+
+        SimdFloat closestDistances, closestIndices;
+        packetDistance(points, SimdFloat::load(ignored), activeLanes, scene, closestDistances, closestIndices, evaluations);
+
+        SimdFloat epsilon(globalDelta);
+        if (cameraRays) {
+            epsilon = simdMax(epsilon, SimdFloat(globalHitOffset) + t * SimdFloat(globalHitSpread));
+        }
+        SimdMask hit = simdLess(closestDistances, epsilon);
+        if (softness > 0.0f) {
+            simdMin(SimdFloat::load(visibility), SimdFloat(softness) * closestDistances / t).store(visibility);
+        }
+        int overshotLanes = 0;
+        if (relaxation > 1.0f) {
+            SimdFloat lastDepth = SimdFloat::load(previousDepth);
+            SimdFloat lastDistance = SimdFloat::load(previousDistance);
+            SimdMask overshot = simdLess(simdAbs(closestDistances) + lastDistance, t - lastDepth);
+
+            overshotLanes = simdBits(overshot) & activeLanes;
+            simdSelect(overshot, lastDepth + lastDistance, simdSelect(hit, t, t + SimdFloat(relaxation) * closestDistances)).store(distance);
+            simdSelect(overshot, lastDepth, t).store(previousDepth);
+            simdSelect(overshot, SimdFloat(std::numeric_limits<float>::infinity()), simdAbs(closestDistances)).store(previousDistance);
+            globalThreadStats.backtracks += std::bitset<32>(overshotLanes).count();
+            int relaxedLanes = simdBits(simdLess(lastDistance, SimdFloat(std::numeric_limits<float>::infinity()))) & activeLanes & ~overshotLanes;
+            globalThreadStats.relaxedSteps += std::bitset<32>(relaxedLanes).count();
+        } else {
+            simdSelect(hit, t, t + closestDistances).store(distance);
+        }
+        closestDistances.store(closest);
+        closestIndices.store(closestIndex);
+
+        int hitLanes = simdBits(hit) & activeLanes & ~overshotLanes;
+        for (int lane = 0; lane < SIMD_WIDTH; lane++) {
+            if (!(activeLanes & (1 << lane))) continue;
+
+            steps[lane]++;
+            bool laneHit = (hitLanes & (1 << lane)) != 0;
+            if (!laneHit && steps[lane] < maxSteps[lane] && distance[lane] < maxDistance[lane]) continue;
+
+            if (laneHit) {
+                results[laneRay[lane]] = { distance[lane], static_cast<int>(closestIndex[lane]), 0.0f, steps[lane], evaluations[lane] };
+            } else {
+                results[laneRay[lane]] = { distance[lane], -1, visibility[lane], steps[lane], evaluations[lane] };
+            }
+            refill(lane);
+        }
+    }
+}
+
+// The marchTilePackets function renders one
+// tile with marchPackets. All of the tile's
+// camera rays are marched first, then a
+// shadow ray for every pixel that hit
+// something, and only then is each hit lit.
+// If costs is given, each pixel's march
+// steps, shadow steps and shape distances
+// are written to its three channels. With
+// --cones, the camera rays start at the
+// depths from coneStartDepths.
+
+void marchTilePackets(CImg<unsigned char>& image, const Scene& scene, const Camera& camera,
+                      int startX, int startY, int endX, int endY, CImg<int>* costs) {
+    std::vector<PacketRay> cameraRays;
+    std::vector<PacketResult> cameraHits;
+    std::vector<PacketRay> shadowRays;
+    std::vector<PacketResult> shadowHits;
+    std::vector<float> startDepths;
+    double setupStart = statsClock();
+
+    if (globalConePrepass) {
+        coneStartDepths(scene, camera, startX, startY, endX, endY, startDepths);
+    }
+
+    for (int y = startY; y < endY; y++) {
+        glm::vec3 pixelPoint = camera.pixelPoint(startX, y);
+
+        for (int x = startX; x < endX; x++) {
+            float startDepth = startDepths.empty() ? 0.0f : startDepths[(y - startY) * (endX - startX) + (x - startX)];
+            PacketRay ray = { camera.rayOrigin(pixelPoint), camera.rayDirection(pixelPoint), startDepth,
+                              static_cast<float>(globalMaxDistance), globalMaxIterations, -1 };
+            cameraRays.push_back(ray);
+            pixelPoint += camera.pixelStepX;
+        }
+    }
+    double marchStart = statsClock();
+    marchPackets(cameraRays, cameraHits, scene, 0.0f, globalRelaxation, true);
+    double shadowStart = statsClock();
+
+    for (size_t i = 0; i < cameraRays.size(); i++) {
+        globalThreadStats.marchSteps += cameraHits[i].steps;
+        if (cameraHits[i].index < 0) continue;
+
+        glm::vec3 hitPoint = cameraRays[i].origin + cameraHits[i].distance * cameraRays[i].direction;
+        PacketRay ray = { hitPoint, glm::normalize(globalLightPosition - hitPoint), globalDelta,
+                          glm::length(globalLightPosition - hitPoint), globalMaxShadowSteps, cameraHits[i].index };
+        shadowRays.push_back(ray);
+    }
+    marchPackets(shadowRays, shadowHits, scene, globalShadowSoftness);
+    double shadingStart = statsClock();
+
+    for (size_t i = 0; i < shadowRays.size(); i++) {
+        globalThreadStats.shadowSteps += shadowHits[i].steps;
+    }
+    globalThreadStats.cameraRays += cameraRays.size();
+    globalThreadStats.hits += shadowRays.size();
+    globalThreadStats.shadowRays += shadowRays.size();
+
+    int shadowRay = 0;
+    for (size_t i = 0; i < cameraRays.size(); i++) {
+        int x = startX + static_cast<int>(i) % (endX - startX);
+        int y = startY + static_cast<int>(i) / (endX - startX);
+        glm::vec3 color(0.0f, 0.0f, 0.0f);
+        int shadowSteps = 0;
+        int evaluations = cameraHits[i].evaluations;
+
+        if (cameraHits[i].index >= 0) {
+            glm::vec3 hitPoint = cameraRays[i].origin + cameraHits[i].distance * cameraRays[i].direction;
+            const PacketResult& shadow = shadowHits[shadowRay++];
+            color = lightPoint(hitPoint, cameraRays[i].direction, cameraHits[i].index, scene, shadow.visibility);
+            shadowSteps = shadow.steps;
+            evaluations += shadow.evaluations;
+        }
+        if (costs) {
+            (*costs)(x, y, 0, 0) = cameraHits[i].steps;
+            (*costs)(x, y, 0, 1) = shadowSteps;
+            (*costs)(x, y, 0, 2) = evaluations;
+        }
+
+        image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
+        image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
+        image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+    }
+
+    globalThreadStats.setupSeconds += marchStart - setupStart;
+    globalThreadStats.marchSeconds += shadowStart - marchStart;
+    globalThreadStats.shadowSeconds += shadingStart - shadowStart;
+    globalThreadStats.shadingSeconds += statsClock() - shadingStart;
+}
+
+// The ProgressReporter struct shows how far
+// along a render is. Worker threads add the
+// pixels of each finished tile to an atomic
+// counter, which never blocks them, and a
+// separate thread prints the percentage done,
+// camera rays per second and time left to
+// stderr every PROGRESS_INTERVAL_MS. The
+// render loops themselves never print
+// anything.
+
+struct ProgressReporter {
+    std::atomic<long long> pixelsDone;
+    long long totalPixels = 0;
+    bool running = false;
+    std::chrono::steady_clock::time_point startTime;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stopRequested;
+
+    ProgressReporter() : pixelsDone(0) {}
+
+    ~ProgressReporter() {
+        stop();
+    }
+
+    void start(long long total) {
+        totalPixels = total;
+        pixelsDone = 0;
+        startTime = std::chrono::steady_clock::now();
+        running = true;
+        thread = std::thread([this]() { reportLoop(); });
+    }
+
+    void addPixels(long long count) {
+        pixelsDone.fetch_add(count, std::memory_order_relaxed);
+    }
+
+    // The last report is printed on its own
+    // line once the render is finished.
+    void stop() {
+        if (!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            running = false;
+        }
+        stopRequested.notify_all();
+        thread.join();
+        report();
+        std::cerr << std::endl;
+    }
+
+    void reportLoop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (!stopRequested.wait_for(lock, std::chrono::milliseconds(PROGRESS_INTERVAL_MS), [this]() { return !running; })) {
+            report();
+        }
+    }
+
+    void report() {
+        long long done = pixelsDone.load(std::memory_order_relaxed);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        double raysPerSecond = seconds > 0.0 ? done / seconds : 0.0;
+        double percent = totalPixels > 0 ? 100.0 * done / totalPixels : 100.0;
+
+        std::cerr << "\r" << std::fixed << std::setprecision(1) << percent << "% done, "
+                  << std::setprecision(2) << raysPerSecond / 1e6 << " Mrays/s, ";
+        if (done >= totalPixels) {
+            std::cerr << std::setprecision(1) << seconds << "s total   " << std::flush;
+        } else if (done > 0) {
+            std::cerr << "ETA " << std::setprecision(1) << (totalPixels - done) / raysPerSecond << "s   " << std::flush;
+        } else {
+            std::cerr << "ETA unknown   " << std::flush;
+        }
+    }
+};
+
+// The renderImage function splits the image
+// into TILE_SIZE x TILE_SIZE tiles and hands
+// them out to a group of worker threads.
+// Every thread grabs the next unclaimed tile
+// from a shared counter until none are left,
+// so fast tiles don't leave a thread idle.
+// Each pixel belongs to exactly one tile, so
+// the threads never write to the same part
+// of the image and no locking is needed.
+// Inside a tile, the camera's pixel point
+// is stepped along each row instead of
+// being rebuilt for every pixel. Unless
+// --quiet is given, progress is reported
+// while the image renders. When a thread
+// runs out of tiles it adds its statistics
+// to the frame's, which are returned. If
+// costs is given, it is filled with every
+// pixel's march steps, shadow steps and
+// shape distances, as in marchTilePackets.
+// With --tile-cull and --cones, each tile's
+// shape lists and start depths are worked
+// out before its pixels are marched.
+
+RenderStats renderImage(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, int threadCount,
+                        CImg<int>* costs = nullptr) {
+    const int tilesX = (globalWidth + TILE_SIZE - 1) / TILE_SIZE;
+    const int tilesY = (globalHeight + TILE_SIZE - 1) / TILE_SIZE;
+    const int tileCount = tilesX * tilesY;
+    std::atomic<int> nextTile(0);
+    ProgressReporter progress;
+    RenderStats frameStats;
+    std::mutex statsMutex;
+
+    auto worker = [&]() {
+        TileCulling tileCulling;
+        std::vector<float> startDepths;
+        globalThreadStats = RenderStats();
+        for (int tile = nextTile++; tile < tileCount; tile = nextTile++) {
+            int startX = (tile % tilesX) * TILE_SIZE;
+            int startY = (tile / tilesX) * TILE_SIZE;
+            int endX = std::min(startX + TILE_SIZE, globalWidth);
+            int endY = std::min(startY + TILE_SIZE, globalHeight);
+
+            if (globalPacketMarching && !globalRayCulling && !globalTileCulling) {
+                marchTilePackets(image, scene, camera, startX, startY, endX, endY, costs);
+            }
+            else {
+                const TileCulling* tiles = nullptr;
+                double setupStart = statsClock();
+                if (globalTileCulling && tileCulling.build(scene, camera, startX, startY, endX, endY)) {
+                    tiles = &tileCulling;
+                }
+                if (globalConePrepass) {
+                    coneStartDepths(scene, camera, startX, startY, endX, endY, startDepths);
+                }
+                globalThreadStats.setupSeconds += statsClock() - setupStart;
+
+                for (int y = startY; y < endY; y++) {
+                    glm::vec3 pixelPoint = camera.pixelPoint(startX, y);
+
+                    for (int x = startX; x < endX; x++) {
+                        RenderStats before = globalThreadStats;
+                        float startDepth = startDepths.empty() ? 0.0f : startDepths[(y - startY) * (endX - startX) + (x - startX)];
+                        glm::vec3 color = marchRay(camera.rayOrigin(pixelPoint), camera.rayDirection(pixelPoint), scene, startDepth, tiles);
+
+                        if (costs) {
+                            (*costs)(x, y, 0, 0) = static_cast<int>(globalThreadStats.marchSteps - before.marchSteps);
+                            (*costs)(x, y, 0, 1) = static_cast<int>(globalThreadStats.shadowSteps - before.shadowSteps);
+                            (*costs)(x, y, 0, 2) = static_cast<int>(globalThreadStats.sdfEvaluations - before.sdfEvaluations);
+                        }
+
+                        image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
+                        image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
+                        image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+                        pixelPoint += camera.pixelStepX;
+                    }
+                }
+            }
+
+            progress.addPixels(static_cast<long long>(endX - startX) * (endY - startY));
+        }
+
+        std::lock_guard<std::mutex> lock(statsMutex);
+        frameStats.add(globalThreadStats);
+    };
+
+    if (globalShowProgress) {
+        progress.start(static_cast<long long>(globalWidth) * globalHeight);
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < threadCount; i++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    progress.stop();
+    return frameStats;
+}
+
+// The imageFormat function works out which
+// format a batch render is saved in: the
+// one given with --format, or else the
+// output file's extension. It returns an
+// empty string for anything other than
+// png, ppm or pfm.
+
+std::string imageFormat(const std::string& outputPath, std::string format) {
+    if (format.empty()) {
+        size_t dot = outputPath.find_last_of('.');
+        if (dot != std::string::npos) format = outputPath.substr(dot + 1);
+    }
+    std::transform(format.begin(), format.end(), format.begin(), [](unsigned char c) { return std::tolower(c); });
+
+    if (format == "png" || format == "ppm" || format == "pfm") return format;
+    return "";
+}
+
+// The saveImage function writes a finished
+// batch render to a file. PFM files hold
+// floats, so the colors are scaled back to
+// the 0 to 1 range first. It returns false
+// if the file can't be written.
+
+bool saveImage(const CImg<unsigned char>& image, const std::string& outputPath, const std::string& format) {
+    try {
+        if (format == "png") {
+            image.save_png(outputPath.c_str());
+        } else if (format == "ppm") {
+            image.save_pnm(outputPath.c_str());
+        } else {
+            (CImg<float>(image) / 255.0f).save_pfm(outputPath.c_str());
+        }
+    }
+    catch (const CImgException& error) {
+        std::cerr << "Error: Could not write " << outputPath << ": " << error.what() << "\n";
+        return false;
+    }
+    return true;
+}
+
+// The heatColor function maps a value from
+// 0 to 1 onto a false color scale running
+// from black through blue, cyan, green and
+// yellow to red.
+
+glm::vec3 heatColor(float value) {
+    static const glm::vec3 stops[] = {
+        glm::vec3(0.0f, 0.0f, 0.0f), glm::vec3(0.0f, 0.0f, 1.0f), glm::vec3(0.0f, 1.0f, 1.0f),
+        glm::vec3(0.0f, 1.0f, 0.0f), glm::vec3(1.0f, 1.0f, 0.0f), glm::vec3(1.0f, 0.0f, 0.0f)
+    };
+    const int lastStop = 5;
+
+    float position = std::min(std::max(value, 0.0f), 1.0f) * lastStop;
+    int stop = std::min(static_cast<int>(position), lastStop - 1);
+    float blend = position - stop;
+    return stops[stop] * (1.0f - blend) + stops[stop + 1] * blend;
+}
+
+// The saveHeatmaps function writes the cost
+// images filled in by renderImage as false
+// color PNGs: prefix-steps.png for march
+// steps, prefix-shadow-steps.png for shadow
+// steps and prefix-sdf-evaluations.png for
+// shape distances. Steps are scaled so red
+// is the scene's step limit, which keeps
+// renders of one scene comparable, and the
+// distances so red is the image's largest
+// count. The full scale of each image is
+// printed. It returns false if any file
+// can't be written.
+
+bool saveHeatmaps(const CImg<int>& costs, const std::string& prefix) {
+    const char* names[3] = { "steps", "shadow-steps", "sdf-evaluations" };
+    int fullScales[3] = { globalMaxIterations, globalMaxShadowSteps, std::max(costs.get_shared_channel(2).max(), 1) };
+    bool saved = true;
+
+    for (int channel = 0; channel < 3; channel++) {
+        CImg<unsigned char> heatmap(costs.width(), costs.height(), 1, 3, 0);
+
+        for (int y = 0; y < costs.height(); y++) {
+            for (int x = 0; x < costs.width(); x++) {
+                glm::vec3 color = heatColor(static_cast<float>(costs(x, y, 0, channel)) / fullScales[channel]);
+
+                heatmap(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
+                heatmap(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
+                heatmap(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+            }
+        }
+
+        std::string path = prefix + "-" + names[channel] + ".png";
+        if (saveImage(heatmap, path, "png")) {
+            std::cout << path << ": red = " << fullScales[channel] << " " << names[channel] << std::endl;
+        } else {
+            saved = false;
+        }
+    }
+    return saved;
+}
+
+// The writeStats function saves a --stats
+// report as JSON. The stage times are wall
+// clock seconds for the whole program, and
+// threadSeconds splits the render's time,
+// summed over all threads, by what the
+// threads were doing. coneSteps are the
+// steps taken by --cones, which aren't in
+// marchSteps. relaxedSteps are the relaxed
+// steps that turned out safe, each of which
+// went factor - 1 plain steps further than
+// a plain step would have. Each backtrack
+// wasted the step that found it, so
+// stepsSavedPerRay estimates the steps
+// relaxation saved from those two counts,
+// without marching the frame again. It
+// returns false if the file can't be
+// written.
+
+bool writeStats(const std::string& statsPath, const std::string& scenePath, const Scene& scene, int threadCount,
+                const RenderStats& stats, double parseSeconds, double buildSeconds, double renderSeconds,
+                double saveSeconds, double totalSeconds) {
+    std::ofstream file(statsPath);
+    if (!file.is_open()) {
+        std::cerr << "Error: Could not write the stats file " << statsPath << "." << std::endl;
+        return false;
+    }
+
+    auto perRay = [](double count, long long rays) { return rays > 0 ? count / rays : 0.0; };
+    double stepsSaved = stats.relaxedSteps * (globalRelaxation - 1.0) - stats.backtracks;
+    std::string sceneName;
+    for (char c : scenePath) {
+        if (c == '"' || c == '\\') sceneName += '\\';
+        sceneName += c;
+    }
+
+    file << std::setprecision(6);
+    file << "{\n";
+    file << "  \"renderer\": \"rayMarcher\",\n";
+    file << "  \"scene\": \"" << sceneName << "\",\n";
+    file << "  \"width\": " << globalWidth << ",\n";
+    file << "  \"height\": " << globalHeight << ",\n";
+    file << "  \"threads\": " << threadCount << ",\n";
+    file << "  \"mode\": \"" << (globalTileCulling ? "tile-culled" : globalRayCulling ? "culled" : globalPacketMarching ? "packet" : "scalar") << "\",\n";
+    file << "  \"shapes\": " << scene.shapes.size() << ",\n";
+    file << "  \"stages\": {\n";
+    file << "    \"parse\": " << parseSeconds << ",\n";
+    file << "    \"build\": " << buildSeconds << ",\n";
+    file << "    \"render\": " << renderSeconds << ",\n";
+    file << "    \"save\": " << saveSeconds << ",\n";
+    file << "    \"total\": " << totalSeconds << "\n";
+    file << "  },\n";
+    file << "  \"threadSeconds\": {\n";
+    file << "    \"setup\": " << stats.setupSeconds << ",\n";
+    file << "    \"march\": " << stats.marchSeconds << ",\n";
+    file << "    \"shadow\": " << stats.shadowSeconds << ",\n";
+    file << "    \"shading\": " << stats.shadingSeconds << "\n";
+    file << "  },\n";
+    file << "  \"cameraRays\": " << stats.cameraRays << ",\n";
+    file << "  \"raysPerSecond\": " << (renderSeconds > 0.0 ? stats.cameraRays / renderSeconds : 0.0) << ",\n";
+    file << "  \"hits\": " << stats.hits << ",\n";
+    file << "  \"marchSteps\": " << stats.marchSteps << ",\n";
+    file << "  \"marchStepsPerRay\": " << perRay(stats.marchSteps, stats.cameraRays) << ",\n";
+    file << "  \"coneSteps\": " << stats.coneSteps << ",\n";
+    file << "  \"coneStepsPerRay\": " << perRay(stats.coneSteps, stats.cameraRays) << ",\n";
+    file << "  \"relaxation\": " << globalRelaxation << ",\n";
+    file << "  \"backtracks\": " << stats.backtracks << ",\n";
+    file << "  \"relaxedSteps\": " << stats.relaxedSteps << ",\n";
+    file << "  \"stepsSavedPerRay\": " << perRay(stepsSaved, stats.cameraRays) << ",\n";
+    file << "  \"sdfEvaluations\": " << stats.sdfEvaluations << ",\n";
+    file << "  \"sdfEvaluationsPerRay\": " << perRay(stats.sdfEvaluations, stats.cameraRays) << ",\n";
+    file << "  \"shadowRays\": " << stats.shadowRays << ",\n";
+    file << "  \"shadowSteps\": " << stats.shadowSteps << ",\n";
+    file << "  \"shadowStepsPerRay\": " << perRay(stats.shadowSteps, stats.shadowRays) << "\n";
+    file << "}\n";
+    return true;
+}
+
+// The timeKernel function times a benchmark
+// kernel that does opsPerCall operations per
+// call. The kernel is called over and over
+// for BENCH_RUN_SECONDS, BENCH_RUNS times,
+// and the fastest run's nanoseconds per
+// operation is returned, since anything
+// slower than that was noise from the rest
+// of the machine.
+
+template <typename Kernel>
+double timeKernel(Kernel kernel, long long opsPerCall) {
+    double best = std::numeric_limits<double>::infinity();
+
+    for (int run = 0; run < BENCH_RUNS; run++) {
+        auto start = std::chrono::steady_clock::now();
+        double elapsed = 0.0;
+        long long calls = 0;
+
+        while (elapsed < BENCH_RUN_SECONDS) {
+            kernel();
+            calls++;
+            elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        }
+        best = std::min(best, elapsed * 1e9 / (calls * opsPerCall));
+    }
+    return best;
+}
+
+// The runKernelBenchmarks function times the
+// scalar signed distance functions against
+// their SIMD versions over BENCH_OPS random
+// points and shapes, and prints the
+// nanoseconds per distance and millions of
+// distances per second for each. The same
+// seed is used every time, so every run
+// measures the same work. The SIMD results
+// must match the scalar ones to within
+// BENCH_MAX_ERROR. If a baseline file is
+// given, any kernel more than driftPercent
+// slower than its baseline time fails the
+// run. The file has one "name nanoseconds"
+// line per kernel, as written by
+// --save-baseline. It returns the exit code.
+
+int runKernelBenchmarks(const std::string& baselinePath, const std::string& savePath, double driftPercent) {
+    std::map<std::string, double> baseline;
+    if (!baselinePath.empty()) {
+        std::ifstream file(baselinePath);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not open the baseline file " << baselinePath << "." << std::endl;
+            return 1;
+        }
+        std::string name;
+        double nanoseconds;
+        while (file >> name >> nanoseconds) {
+            baseline[name] = nanoseconds;
+        }
+    }
+
+    std::mt19937 random(42);
+    std::uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+    std::uniform_real_distribution<float> size(0.2f, 1.0f);
+    auto randomPoint = [&](float scale) {
+        float x = coordinate(random);
+        float y = coordinate(random);
+        float z = coordinate(random);
+        return glm::vec3(x, y, z) * scale;
+    };
+
+    // One shape of each type for every point.
+    // SoaScene keeps each type in its own lists
+    // in the order given, so shape i of a type
+    // lines up with point i.
+    std::vector<glm::vec3> points;
+    SoaVec3 soaPoints;
+    std::vector<Shape> shapes;
+    for (int i = 0; i < BENCH_OPS; i++) {
+        points.push_back(randomPoint(3.0f));
+        soaPoints.push(points.back());
+
+        Shape sphere(Shape::SPHERE);
+        sphere.setSphere({ randomPoint(1.0f), size(random), glm::vec3(1.0f) });
+        Shape triangle(Shape::TRIANGLE);
+        triangle.setTriangle({ randomPoint(1.0f), randomPoint(1.0f), randomPoint(1.0f), glm::vec3(1.0f) });
+        Shape box(Shape::BOX);
+        box.setBox({ randomPoint(1.0f), size(random), glm::vec3(1.0f) });
+        Shape cylinder(Shape::CYLINDER);
+        cylinder.setCylinder({ randomPoint(1.0f), size(random), size(random), glm::vec3(1.0f) });
+
+        shapes.push_back(sphere);
+        shapes.push_back(triangle);
+        shapes.push_back(box);
+        shapes.push_back(cylinder);
+    }
+    SoaScene soa;
+    soa.build(shapes);
+
+    std::vector<float> scalarResults(BENCH_OPS);
+    std::vector<float> simdResults(BENCH_OPS);
+    std::vector<std::pair<std::string, double>> timings;
+    bool passed = true;
+
+    auto benchmark = [&](const std::string& name, auto scalarKernel, auto simdKernel) {
+        timings.push_back({ name, timeKernel(scalarKernel, BENCH_OPS) });
+        timings.push_back({ "simd" + std::string(1, static_cast<char>(std::toupper(name[0]))) + name.substr(1),
+                            timeKernel(simdKernel, BENCH_OPS) });
+
+        float maxError = 0.0f;
+        for (int i = 0; i < BENCH_OPS; i++) {
+            float error = std::fabs(scalarResults[i] - simdResults[i]) / std::max(1.0f, std::fabs(scalarResults[i]));
+            if (!(error <= maxError)) maxError = error;
+        }
+        if (!(maxError <= BENCH_MAX_ERROR)) {
+            std::cerr << "Error: " << timings.back().first << " differs from " << name << " by up to " << maxError << "." << std::endl;
+            passed = false;
+        }
+    };
+
+    benchmark("signedDistanceSphere", [&]() {
+        for (int i = 0; i < BENCH_OPS; i++) scalarResults[i] = signedDistanceSphere(points[i], shapes[4 * i].sphere);
+    }, [&]() {
+        for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+            simdSignedDistanceSphere(soaPoints.load(i), soa.sphereCenters.load(i), SimdFloat::load(&soa.sphereRadii[i])).store(&simdResults[i]);
+        }
+    });
+    benchmark("signedDistanceTriangle", [&]() {
+        for (int i = 0; i < BENCH_OPS; i++) scalarResults[i] = signedDistanceTriangle(points[i], shapes[4 * i + 1].triangle);
+    }, [&]() {
+        for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+            simdSignedDistanceTriangle(soaPoints.load(i), soa.loadTriangles(i)).store(&simdResults[i]);
+        }
+    });
+    benchmark("signedDistanceBox", [&]() {
+        for (int i = 0; i < BENCH_OPS; i++) scalarResults[i] = signedDistanceBox(points[i], shapes[4 * i + 2].box);
+    }, [&]() {
+        for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+            simdSignedDistanceBox(soaPoints.load(i), soa.boxCenters.load(i), SimdFloat::load(&soa.boxHalfSizes[i])).store(&simdResults[i]);
+        }
+    });
+    benchmark("signedDistanceCylinder", [&]() {
+        for (int i = 0; i < BENCH_OPS; i++) scalarResults[i] = signedDistanceCylinder(points[i], shapes[4 * i + 3].cylinder);
+    }, [&]() {
+        for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+            simdSignedDistanceCylinder(soaPoints.load(i), soa.cylinderCenters.load(i), SimdFloat::load(&soa.cylinderRadii[i]),
+                                       SimdFloat::load(&soa.cylinderHalfHeights[i])).store(&simdResults[i]);
+        }
+    });
+
+    std::cout << std::left << std::setw(30) << "kernel" << std::right << std::setw(10) << "ns/op"
+              << std::setw(12) << "Mops/s" << std::setw(12) << "baseline" << std::setw(10) << "change" << "\n";
+    std::cout << std::fixed;
+    for (const auto& timing : timings) {
+        std::cout << std::left << std::setw(30) << timing.first << std::right << std::setprecision(3)
+                  << std::setw(10) << timing.second << std::setprecision(1) << std::setw(12) << 1000.0 / timing.second;
+
+        auto stored = baseline.find(timing.first);
+        if (stored != baseline.end()) {
+            double change = (timing.second / stored->second - 1.0) * 100.0;
+            std::cout << std::setprecision(3) << std::setw(12) << stored->second << std::setprecision(1)
+                      << std::setw(9) << std::showpos << change << std::noshowpos << "%";
+            if (change > driftPercent) {
+                std::cout << "  slower than the baseline";
+                passed = false;
+            }
+        }
+        std::cout << "\n";
+    }
+    std::cout << std::defaultfloat;
+
+    if (!savePath.empty()) {
+        std::ofstream file(savePath);
+        if (!file.is_open()) {
+            std::cerr << "Error: Could not write the baseline file " << savePath << "." << std::endl;
+            return 1;
+        }
+        for (const auto& timing : timings) {
+            file << timing.first << " " << timing.second << "\n";
+        }
+    }
+
+    return passed ? 0 : 1;
+}
+
+// This is the main function of this
+// program. It calls in a scene
+// description file with instructions
+// for how the scene is laid out and
+// renders it with renderImage. The
+// optional arguments are:
+//
+// -t, --threads N       threads to render with
+// --scalar              march one ray at a time
+//                       instead of in SIMD packets
+// --cull                march one ray at a time,
+//                       each only looking at the
+//                       shapes whose bounds it
+//                       passes through (see
+//                       RayCandidates)
+// --tile-cull           march one ray at a time,
+//                       each only looking at the
+//                       shapes its tile can see at
+//                       its depth (see TileCulling)
+// --cones               start rays at depths found
+//                       by marching cones over
+//                       blocks of pixels first
+//                       (see coneStartDepths)
+// -q, --quiet           don't report progress
+// -s, --scene FILE      scene file (scene.txt)
+// -o, --output FILE     save the image to FILE and
+//                       exit instead of showing it
+// -f, --format FORMAT   png, ppm or pfm (taken from
+//                       the output file's extension
+//                       by default)
+// --stats FILE          write counters and timings
+//                       to FILE as JSON
+// --heatmaps PREFIX     also save false color images
+//                       of each pixel's march steps,
+//                       shadow steps and shape
+//                       distances (see saveHeatmaps)
+// --bench               time the distance functions
+//                       instead of rendering (see
+//                       runKernelBenchmarks)
+// --baseline FILE       fail the benchmark if a
+//                       kernel is slower than in FILE
+// --save-baseline FILE  save the benchmark times
+// --drift PERCENT       how much slower is allowed (10)
+//
+// ./rayMarcher -t 8 -s scene2.txt -o scene2.png
+//
+// By default one thread is used for
+// every core on the machine, and packets
+// are used whenever AVX2 is available.
+// With --output nothing is displayed, so
+// the program can run on machines with no
+// screen; building it with -Dcimg_display=0
+// also drops the need for X11. The exit
+// code is 0 on success and 1 if the scene
+// couldn't be read or the image couldn't be
+// written.
+
+int main(int argc, char* argv[]) {
+    int threadCount = static_cast<int>(std::thread::hardware_concurrency());
+    std::string scenePath = "scene.txt";
+    std::string outputPath;
+    std::string format;
+    std::string statsPath;
+    std::string heatmapPrefix;
+    bool benchmark = false;
+    std::string baselinePath;
+    std::string saveBaselinePath;
+    double driftPercent = 10.0;
+    auto programStart = std::chrono::steady_clock::now();
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+            threadCount = std::atoi(argv[++i]);
+        }
+        else if (arg == "--scalar") {
+            globalPacketMarching = false;
+        }
+        else if (arg == "--cull") {
+            globalRayCulling = true;
+        }
+        else if (arg == "--tile-cull") {
+            globalTileCulling = true;
+        }
+        else if (arg == "--cones") {
+            globalConePrepass = true;
+        }
+        else if (arg == "-q" || arg == "--quiet") {
+            globalShowProgress = false;
+        }
+        else if ((arg == "-s" || arg == "--scene") && i + 1 < argc) {
+            scenePath = argv[++i];
+        }
+        else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+            outputPath = argv[++i];
+        }
+        else if ((arg == "-f" || arg == "--format") && i + 1 < argc) {
+            format = argv[++i];
+        }
+        else if (arg == "--stats" && i + 1 < argc) {
+            statsPath = argv[++i];
+            globalCollectStats = true;
+        }
+        else if (arg == "--heatmaps" && i + 1 < argc) {
+            heatmapPrefix = argv[++i];
+        }
+        else if (arg == "--bench") {
+            benchmark = true;
+        }
+        else if (arg == "--baseline" && i + 1 < argc) {
+            baselinePath = argv[++i];
+        }
+        else if (arg == "--save-baseline" && i + 1 < argc) {
+            saveBaselinePath = argv[++i];
+        }
+        else if (arg == "--drift" && i + 1 < argc) {
+            driftPercent = std::atof(argv[++i]);
+        }
+        else {
+            std::cerr << "Usage: " << argv[0] << " [-t threads] [--scalar] [--cull] [--tile-cull] [--cones] [-q] [-s scene.txt] [-o output] [-f png|ppm|pfm] [--stats stats.json] [--heatmaps prefix]\n"
+                      << "       " << argv[0] << " --bench [--baseline file] [--save-baseline file] [--drift percent]\n";
+            return 1;
+        }
+    }
+    if (threadCount < 1) threadCount = 1;
+
+    if (benchmark) {
+        return runKernelBenchmarks(baselinePath, saveBaselinePath, driftPercent);
+    }
+
+    if (!outputPath.empty()) {
+        // saveImage reports write errors itself.
+        cimg::exception_mode(0);
+        format = imageFormat(outputPath, format);
+        if (format.empty()) {
+            std::cerr << "Error: The output format must be png, ppm or pfm.\n";
+            return 1;
+        }
+    }
+
+    Scene scene;
+    if (!readSetupFile(scenePath, scene.shapes)) {
+        return 1;
+    }
+    if (globalWidth <= 0 || globalHeight <= 0) {
+        std::cerr << "Error: The setup file has no image size.\n";
+        return 1;
+    }
+    auto parseEnd = std::chrono::steady_clock::now();
+    scene.build();
+    auto buildEnd = std::chrono::steady_clock::now();
+
+    CImg<unsigned char> image(globalWidth, globalHeight, 1, 3, 0);
+
+    Camera camera;
+    camera.setup(globalCameraPosition, globalCameraTarget, globalCameraUp, globalWidth, globalHeight,
+                 globalCameraOrthographic ? Camera::ORTHOGRAPHIC : Camera::PERSPECTIVE, globalCameraOrthoHalfHeight);
+    if (globalPixelEpsilon > 0.0f) {
+        globalHitOffset = globalPixelEpsilon * camera.footprintOffset;
+        globalHitSpread = globalPixelEpsilon * camera.footprintSpread;
+    }
+
+    // Ray Marching Loop
+    CImg<int> costs;
+    if (!heatmapPrefix.empty()) {
+        costs.assign(globalWidth, globalHeight, 1, 3, 0);
+    }
+    RenderStats stats = renderImage(image, scene, camera, threadCount, heatmapPrefix.empty() ? nullptr : &costs);
+    auto renderEnd = std::chrono::steady_clock::now();
+
+    bool saved = outputPath.empty() || saveImage(image, outputPath, format);
+    if (!heatmapPrefix.empty()) {
+        cimg::exception_mode(0);
+        saved = saveHeatmaps(costs, heatmapPrefix) && saved;
+    }
+    auto saveEnd = std::chrono::steady_clock::now();
+
+    if (!statsPath.empty()) {
+        auto seconds = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+            return std::chrono::duration<double>(b - a).count();
+        };
+        if (!writeStats(statsPath, scenePath, scene, threadCount, stats, seconds(programStart, parseEnd),
+                        seconds(parseEnd, buildEnd), seconds(buildEnd, renderEnd), seconds(renderEnd, saveEnd),
+                        seconds(programStart, saveEnd))) {
+            return 1;
+        }
+    }
+    if (!outputPath.empty()) {
+        return saved ? 0 : 1;
+    }
+
     image.display("Ray Marching");
 
     return 0;
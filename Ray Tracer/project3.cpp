@@ -4,9 +4,37 @@
 #include <sstream>
 #include <vector>
 #include <map>
+#include <limits>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <cstdlib>
+#include <cmath>
+#include <cctype>
+#include <chrono>
+#include <iomanip>
+#include <random>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include <glm/glm.hpp>
 #include <glm/ext.hpp>
 #define EPSILON 1e-6
+#define TILE_SIZE 16
+#define PACKET_SIZE 8
+#define PACKET_RAYS (PACKET_SIZE * PACKET_SIZE)
+#define BVH_BINS 16
+#define BVH_LEAF_SIZE 4
+#define BVH_MAX_DEPTH 60
+#define BVH_TRAVERSAL_COST 1.0f
+#define BENCH_OPS 4096
+#define BENCH_RAYS_PER_SHAPE 16
+#define BENCH_RUNS 5
+#define BENCH_RUN_SECONDS 0.05
+#define BENCH_MAX_ERROR 1e-4f
 
 #define cimg_use_png
 #include "CImg.h"
@@ -19,6 +47,14 @@ glm::vec3 globalRayDirection;
 float parentRotationAngle = 0.0f;
 int globalWidth;
 int globalHeight;
+bool globalCameraOrthographic = false;
+float globalCameraOrthoHalfHeight = 1.0f;
+#if defined(__AVX2__)
+bool globalPacketTracing = true;
+#else
+bool globalPacketTracing = false;
+#endif
+bool globalCollectStats = false;
 
 using namespace cimg_library;
 
@@ -26,7 +62,16 @@ using namespace cimg_library;
 // based virtual machine. The following line was
 // successfully used to compile this code:
 //
-// g++ -o a project3.cpp -lpng -lpthread -lX11 -lm
+// g++ -O2 -mavx2 -o a project3.cpp -lpng -lpthread -lX11 -lm
+//
+// or, for batch renders on machines without X11:
+//
+// g++ -O2 -mavx2 -Dcimg_display=0 -o a project3.cpp -lpng -lpthread -lm
+//
+// -mavx2 turns on the SIMD ray packets
+// (-march=native also picks up AVX-512
+// where the CPU has it). Leaving it out
+// still works, one ray at a time.
 //
 // Project3.cpp uses CImg and glm to read a scene
 // description file, create a list of objects and
@@ -36,9 +81,10 @@ using namespace cimg_library;
 
 // !!!!!!!!!!!!!!!!!!IMPORTANT!!!!!!!!!!!!!!!!!!!!!
 // Use the arrow keys to move the object left, right,
-// forwards, or backwards. Only make one input at a
-// time, and be patient because (at least on my
-// laptop, it can take almost 10 seconds to complete).
+// forwards, or backwards. Frames are drawn in the
+// background, so keys can be pressed as fast as you
+// like: a new press cancels the frame in progress
+// and only the latest position gets drawn.
 // Use the "Q" and "E" keys to the turn the object
 // left or right. All changes are made to the first
 // object in the scene file, which is assumed to be
@@ -49,6 +95,9 @@ using namespace cimg_library;
 // camera_position x y z
 // camera_target x y z
 // camera_up x y z
+// camera_projection perspective (optional, the default)
+//   OR
+// camera_projection orthographic half_height
 //
 // sphere x y z size r g b
 //   OR
@@ -99,6 +148,12 @@ struct Plane {
 // This is the overall Shape struct, which
 // can be used for any of the three shapes,
 // and includes a number of setters/getters.
+// Rays are tested in the shape's own space,
+// so applyTransform also stores the inverse
+// transform and the matrix used to bring
+// normals back to world space. That way
+// they are only recomputed when the shape
+// is moved, not for every ray.
 struct Shape {
   enum Type { SPHERE, TRIANGLE, PLANE };
   Type type;
@@ -109,8 +164,11 @@ struct Shape {
   };
   glm::vec3 color;
   glm::mat4 transform;
+  glm::mat4 inverseTransform;
+  glm::mat4 normalMatrix;
+  bool hasTransform;
   std::vector<int> children;
-  Shape(Type t) : type(t), transform(glm::mat4(1.0f)) {}
+  Shape(Type t) : type(t), transform(glm::mat4(1.0f)), inverseTransform(glm::mat4(1.0f)), normalMatrix(glm::mat4(1.0f)), hasTransform(false) {}
 
   void setSphere(const Sphere& s) {
     sphere = s;
@@ -122,13 +180,19 @@ struct Shape {
     color = t.color;
   }
 
+  // The normal is normalized here so that shapes
+  // without a transform can use it as it is.
   void setPlane(const Plane& p) {
     plane = p;
+    plane.normal = glm::normalize(p.normal);
     color = p.color;
   }
 
   void applyTransform(const glm::mat4& newTransform) {
     transform = newTransform;
+    hasTransform = (newTransform != glm::mat4(1.0f));
+    inverseTransform = glm::inverse(newTransform);
+    normalMatrix = glm::transpose(inverseTransform);
   }
 
   glm::mat4 getTransform() const {
@@ -136,6 +200,85 @@ struct Shape {
   }
 };
 
+// The Camera struct builds the camera basis
+// once per frame, so no matrix has to be
+// inverted while rendering. Every pixel is
+// described by a point that moves by a fixed
+// step from one column or row to the next,
+// which lets the render loops walk along a
+// row with a single vector addition. In
+// perspective mode the point gives the ray
+// direction, and it matches the rays of
+// the original per-pixel inverse(viewMatrix)
+// code, so old scenes render the same. In
+// orthographic mode the point is the ray
+// origin instead and all rays point the
+// same way.
+//
+// camera_projection perspective
+//   OR
+// camera_projection orthographic half_height
+struct Camera {
+  enum Projection { PERSPECTIVE, ORTHOGRAPHIC };
+  Projection projection;
+  glm::vec3 position;
+  glm::vec3 forward;
+  glm::vec3 pixelOrigin;
+  glm::vec3 pixelStepX;
+  glm::vec3 pixelStepY;
+
+  void setup(const glm::vec3& eye, const glm::vec3& target, const glm::vec3& up, int width, int height, Projection mode, float orthoHalfHeight) {
+    float aspectRatio = static_cast<float>(width) / height;
+
+    projection = mode;
+    position = eye;
+    forward = glm::normalize(target - eye);
+    glm::vec3 right = glm::normalize(glm::cross(forward, up));
+    glm::vec3 cameraUp = glm::cross(right, forward);
+
+    if (projection == PERSPECTIVE) {
+      pixelOrigin = eye + forward - aspectRatio * right + cameraUp;
+      pixelStepX = right * (2.0f * aspectRatio / width);
+      pixelStepY = -cameraUp * (2.0f / height);
+    }
+    else {
+      pixelOrigin = eye + orthoHalfHeight * (aspectRatio * right - cameraUp);
+      pixelStepX = -right * (2.0f * aspectRatio * orthoHalfHeight / width);
+      pixelStepY = cameraUp * (2.0f * orthoHalfHeight / height);
+    }
+  }
+
+  glm::vec3 pixelPoint(int x, int y) const {
+    return pixelOrigin + static_cast<float>(x) * pixelStepX + static_cast<float>(y) * pixelStepY;
+  }
+
+  glm::vec3 rayOrigin(const glm::vec3& point) const {
+    return projection == PERSPECTIVE ? position : point;
+  }
+
+  glm::vec3 rayDirection(const glm::vec3& point) const {
+    return projection == PERSPECTIVE ? -glm::normalize(point) : forward;
+  }
+
+  // The project function finds the pixel
+  // coordinates whose ray passes through a
+  // world space point by solving for the
+  // pixel point and the distance along the
+  // ray at once. It returns false if the
+  // point is behind the camera.
+  bool project(const glm::vec3& point, float& x, float& y) const {
+    glm::vec3 along = projection == PERSPECTIVE ? point - position : forward;
+    glm::vec3 target = projection == PERSPECTIVE ? -pixelOrigin : point - pixelOrigin;
+    float det = glm::dot(pixelStepX, glm::cross(pixelStepY, along));
+    if (glm::abs(det) < EPSILON) return false;
+
+    x = glm::dot(target, glm::cross(pixelStepY, along)) / det;
+    y = glm::dot(pixelStepX, glm::cross(target, along)) / det;
+    float depth = glm::dot(pixelStepX, glm::cross(pixelStepY, target)) / det;
+    return depth > 0.0f;
+  }
+};
+
 // This is the intersection calculator for
 // spheres, which finds if a ray hits a
 // sphere based on its position and size.
@@ -228,33 +371,903 @@ bool intersect(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const
   }
 }
 
-// This is the traceRay function, which
-// detects what shapes are hit by any
-// given ray. To make sure that the
-// frontmost object in a scene is
-// properly shown, it goes through every
-// shape in the scene for every ray.
-glm::vec3 traceRay(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const std::vector<Shape>& shapes) {
-  float closestT = std::numeric_limits<float>::infinity();
-  glm::vec3 closestNormal;
-  glm::vec3 closestColor;
-
-  for (const auto& shape : shapes) {
-    glm::mat4 inverseTransform = glm::inverse(shape.getTransform());
-    glm::vec3 localRayOrigin = glm::vec3(inverseTransform * glm::vec4(rayOrigin, 1.0f));
-    glm::vec3 localRayDirection = glm::vec3(inverseTransform * glm::vec4(rayDirection, 0.0f));
-    
+// RenderStats counts the work done while
+// rendering a frame. Every worker thread
+// adds to its own copy in globalThreadStats,
+// so the counters need no locking, and the
+// render pool adds the copies together when
+// the thread is done with the frame. A
+// packet counts one intersection or box test
+// for each of its rays. The times are summed
+// over all threads, and are only measured
+// when --stats is given.
+struct RenderStats {
+  long long cameraRays = 0;
+  long long hits = 0;
+  long long intersectionTests = 0;
+  long long boxTests = 0;
+  double setupSeconds = 0.0;
+  double traceSeconds = 0.0;
+  double writeSeconds = 0.0;
+
+  void add(const RenderStats& other) {
+    cameraRays += other.cameraRays;
+    hits += other.hits;
+    intersectionTests += other.intersectionTests;
+    boxTests += other.boxTests;
+    setupSeconds += other.setupSeconds;
+    traceSeconds += other.traceSeconds;
+    writeSeconds += other.writeSeconds;
+  }
+};
+
+thread_local RenderStats globalThreadStats;
+
+// The statsClock function returns the time
+// in seconds, or always 0 when stats are
+// off, so differences of it can be added to
+// the stage times either way.
+double statsClock() {
+  if (!globalCollectStats) return 0.0;
+  return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// The intersectShape function moves the ray
+// into the shape's own space using the
+// shape's stored inverse transform, tests
+// it there, and brings the normal back to
+// world space. The local ray direction isn't
+// normalized, so t means the same distance
+// in both. Shapes without a transform are
+// tested directly.
+bool intersectShape(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const Shape& shape, float& t, glm::vec3& normal) {
+  if (!shape.hasTransform) {
+    return intersect(rayOrigin, rayDirection, shape, t, normal);
+  }
+
+  glm::vec3 localRayOrigin = glm::vec3(shape.inverseTransform * glm::vec4(rayOrigin, 1.0f));
+  glm::vec3 localRayDirection = glm::vec3(shape.inverseTransform * glm::vec4(rayDirection, 0.0f));
+
+  if (!intersect(localRayOrigin, localRayDirection, shape, t, normal)) {
+    return false;
+  }
+  normal = glm::normalize(glm::vec3(shape.normalMatrix * glm::vec4(normal, 0.0f)));
+  return true;
+}
+
+// SimdFloat holds SIMD_WIDTH floats that are
+// worked on together, so one instruction can
+// test a ray packet against a shape for many
+// rays at once. With AVX-512 that is sixteen
+// rays per instruction and with AVX2 (-mavx2)
+// eight. Without either the operations are
+// plain loops that give the same answers.
+// Comparisons return a SimdMask, and
+// simdBits turns a mask into one bit per
+// lane so the packet code can combine them
+// with ordinary integer operations.
+#if defined(__AVX512F__)
+
+#define SIMD_WIDTH 16
+
+struct SimdFloat {
+  __m512 v;
+  SimdFloat() {}
+  SimdFloat(__m512 value) : v(value) {}
+  SimdFloat(float value) : v(_mm512_set1_ps(value)) {}
+
+  static SimdFloat load(const float* values) { return _mm512_loadu_ps(values); }
+  void store(float* values) const { _mm512_storeu_ps(values, v); }
+};
+
+struct SimdMask {
+  __mmask16 v;
+  SimdMask(__mmask16 value) : v(value) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm512_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm512_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm512_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm512_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm512_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm512_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm512_sqrt_ps(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return _mm512_abs_ps(a.v); }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LE_OQ); }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_EQ_OQ); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { return _mm512_mask_blend_ps(mask.v, b.v, a.v); }
+inline SimdFloat simdSelectBits(int bits, SimdFloat a, SimdFloat b) { return _mm512_mask_blend_ps(static_cast<__mmask16>(bits), b.v, a.v); }
+inline int simdBits(SimdMask mask) { return mask.v; }
+
+#elif defined(__AVX2__)
+
+#define SIMD_WIDTH 8
+
+struct SimdFloat {
+  __m256 v;
+  SimdFloat() {}
+  SimdFloat(__m256 value) : v(value) {}
+  SimdFloat(float value) : v(_mm256_set1_ps(value)) {}
+
+  static SimdFloat load(const float* values) { return _mm256_loadu_ps(values); }
+  void store(float* values) const { _mm256_storeu_ps(values, v); }
+};
+
+struct SimdMask {
+  __m256 v;
+  SimdMask(__m256 value) : v(value) {}
+};
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { return _mm256_add_ps(a.v, b.v); }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { return _mm256_sub_ps(a.v, b.v); }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { return _mm256_mul_ps(a.v, b.v); }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { return _mm256_div_ps(a.v, b.v); }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { return _mm256_min_ps(a.v, b.v); }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { return _mm256_max_ps(a.v, b.v); }
+inline SimdFloat simdSqrt(SimdFloat a) { return _mm256_sqrt_ps(a.v); }
+inline SimdFloat simdAbs(SimdFloat a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a.v); }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LE_OQ); }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { return _mm256_cmp_ps(a.v, b.v, _CMP_EQ_OQ); }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { return _mm256_blendv_ps(b.v, a.v, mask.v); }
+inline int simdBits(SimdMask mask) { return _mm256_movemask_ps(mask.v); }
+
+inline SimdFloat simdSelectBits(int bits, SimdFloat a, SimdFloat b) {
+  __m256i lanes = _mm256_setr_epi32(1, 2, 4, 8, 16, 32, 64, 128);
+  __m256i chosen = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_set1_epi32(bits), lanes), lanes);
+  return _mm256_blendv_ps(b.v, a.v, _mm256_castsi256_ps(chosen));
+}
+
+#else
+
+#define SIMD_WIDTH 8
+
+struct SimdFloat {
+  float v[SIMD_WIDTH];
+  SimdFloat() {}
+  SimdFloat(float value) { for (int i = 0; i < SIMD_WIDTH; i++) v[i] = value; }
+
+  static SimdFloat load(const float* values) {
+    SimdFloat result;
+    for (int i = 0; i < SIMD_WIDTH; i++) result.v[i] = values[i];
+    return result;
+  }
+  void store(float* values) const { for (int i = 0; i < SIMD_WIDTH; i++) values[i] = v[i]; }
+};
+
+struct SimdMask {
+  bool v[SIMD_WIDTH];
+};
+
+#define SIMD_LANEWISE(type, expression) type result; for (int i = 0; i < SIMD_WIDTH; i++) result.v[i] = (expression); return result;
+
+inline SimdFloat operator+(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] + b.v[i]) }
+inline SimdFloat operator-(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] - b.v[i]) }
+inline SimdFloat operator*(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] * b.v[i]) }
+inline SimdFloat operator/(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] / b.v[i]) }
+inline SimdFloat simdMin(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] < b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat simdMax(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, a.v[i] > b.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat simdSqrt(SimdFloat a) { SIMD_LANEWISE(SimdFloat, std::sqrt(a.v[i])) }
+inline SimdFloat simdAbs(SimdFloat a) { SIMD_LANEWISE(SimdFloat, std::fabs(a.v[i])) }
+inline SimdMask simdLess(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdMask, a.v[i] < b.v[i]) }
+inline SimdMask simdLessEqual(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdMask, a.v[i] <= b.v[i]) }
+inline SimdMask simdEqual(SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdMask, a.v[i] == b.v[i]) }
+inline SimdFloat simdSelect(SimdMask mask, SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, mask.v[i] ? a.v[i] : b.v[i]) }
+inline SimdFloat simdSelectBits(int bits, SimdFloat a, SimdFloat b) { SIMD_LANEWISE(SimdFloat, (bits & (1 << i)) ? a.v[i] : b.v[i]) }
+
+#undef SIMD_LANEWISE
+
+inline int simdBits(SimdMask mask) {
+  int bits = 0;
+  for (int i = 0; i < SIMD_WIDTH; i++) {
+    if (mask.v[i]) bits |= 1 << i;
+  }
+  return bits;
+}
+
+#endif
+
+// SimdVec3 is SIMD_WIDTH points or vectors
+// stored as one SimdFloat per axis.
+struct SimdVec3 {
+  SimdFloat x, y, z;
+  SimdVec3() {}
+  SimdVec3(SimdFloat x, SimdFloat y, SimdFloat z) : x(x), y(y), z(z) {}
+  SimdVec3(const glm::vec3& v) : x(v.x), y(v.y), z(v.z) {}
+};
+
+inline SimdVec3 operator+(const SimdVec3& a, const SimdVec3& b) { return SimdVec3(a.x + b.x, a.y + b.y, a.z + b.z); }
+inline SimdVec3 operator-(const SimdVec3& a, const SimdVec3& b) { return SimdVec3(a.x - b.x, a.y - b.y, a.z - b.z); }
+inline SimdVec3 operator*(SimdFloat s, const SimdVec3& a) { return SimdVec3(s * a.x, s * a.y, s * a.z); }
+inline SimdFloat simdDot(const SimdVec3& a, const SimdVec3& b) { return a.x * b.x + a.y * b.y + a.z * b.z; }
+
+inline SimdVec3 simdCross(const SimdVec3& a, const SimdVec3& b) {
+  return SimdVec3(a.y * b.z - b.y * a.z, a.z * b.x - b.z * a.x, a.x * b.y - b.x * a.y);
+}
+
+// These move SIMD_WIDTH points or directions
+// by a matrix, adding up the columns in
+// pairs the way glm does for one vector.
+inline SimdVec3 simdTransformPoint(const glm::mat4& m, const SimdVec3& p) {
+  return SimdVec3((SimdFloat(m[0][0]) * p.x + SimdFloat(m[1][0]) * p.y) + (SimdFloat(m[2][0]) * p.z + SimdFloat(m[3][0])),
+		  (SimdFloat(m[0][1]) * p.x + SimdFloat(m[1][1]) * p.y) + (SimdFloat(m[2][1]) * p.z + SimdFloat(m[3][1])),
+		  (SimdFloat(m[0][2]) * p.x + SimdFloat(m[1][2]) * p.y) + (SimdFloat(m[2][2]) * p.z + SimdFloat(m[3][2])));
+}
+
+inline SimdVec3 simdTransformDirection(const glm::mat4& m, const SimdVec3& d) {
+  return SimdVec3((SimdFloat(m[0][0]) * d.x + SimdFloat(m[1][0]) * d.y) + SimdFloat(m[2][0]) * d.z,
+		  (SimdFloat(m[0][1]) * d.x + SimdFloat(m[1][1]) * d.y) + SimdFloat(m[2][1]) * d.z,
+		  (SimdFloat(m[0][2]) * d.x + SimdFloat(m[1][2]) * d.y) + SimdFloat(m[2][2]) * d.z);
+}
+
+// These are the intersection calculators
+// from above for SIMD_WIDTH rays at once.
+// They follow the one ray versions step by
+// step, so a ray gets the same answer
+// either way. Each returns one bit per ray
+// that hits, with the distances in t. The
+// packets only need the distance, so no
+// normals are worked out here.
+int simdIntersectSphere(const SimdVec3& rayOrigin, const SimdVec3& rayDirection, const Sphere& sphere, SimdFloat& t) {
+  SimdVec3 center(sphere.center);
+  SimdFloat radius(sphere.radius);
+  SimdVec3 rayToSphere = center - rayOrigin;
+  SimdFloat projection = simdDot(rayToSphere, rayDirection);
+  SimdVec3 closestPoint = rayOrigin + projection * rayDirection;
+  SimdVec3 offset = closestPoint - center;
+  SimdFloat distanceToCenter = simdSqrt(simdDot(offset, offset));
+
+  t = projection - simdSqrt(radius * radius - distanceToCenter * distanceToCenter);
+  return simdBits(simdLessEqual(distanceToCenter, radius)) & simdBits(simdLessEqual(SimdFloat(0.0f), t));
+}
+
+int simdIntersectTriangle(const SimdVec3& rayOrigin, const SimdVec3& rayDirection, const Triangle& triangle, SimdFloat& t) {
+  SimdVec3 edge1(triangle.vertex2 - triangle.vertex1);
+  SimdVec3 edge2(triangle.vertex3 - triangle.vertex1);
+  SimdVec3 h = simdCross(rayDirection, edge2);
+  SimdFloat a = simdDot(edge1, h);
+  int rejected = simdBits(simdLess(SimdFloat(-EPSILON), a)) & simdBits(simdLess(a, SimdFloat(EPSILON)));
+
+  SimdFloat f = SimdFloat(1.0f) / a;
+  SimdVec3 s = rayOrigin - SimdVec3(triangle.vertex1);
+  SimdFloat u = f * simdDot(s, h);
+  rejected |= simdBits(simdLess(u, SimdFloat(0.0f))) | simdBits(simdLess(SimdFloat(1.0f), u));
+
+  SimdVec3 q = simdCross(s, edge1);
+  SimdFloat v = f * simdDot(rayDirection, q);
+  rejected |= simdBits(simdLess(v, SimdFloat(0.0f))) | simdBits(simdLess(SimdFloat(1.0f), u + v));
+
+  t = f * simdDot(edge2, q);
+  return simdBits(simdLess(SimdFloat(EPSILON), t)) & ~rejected;
+}
+
+int simdIntersectPlane(const SimdVec3& rayOrigin, const SimdVec3& rayDirection, const Plane& plane, SimdFloat& t) {
+  SimdVec3 normal(plane.normal);
+  SimdVec3 w0 = rayOrigin - SimdVec3(plane.point);
+  SimdFloat a = SimdFloat(0.0f) - simdDot(normal, w0);
+  SimdFloat b = simdDot(rayDirection, normal);
+  int rejected = simdBits(simdLess(simdAbs(b), SimdFloat(EPSILON)));
+
+  t = a / b;
+  return simdBits(simdLessEqual(SimdFloat(0.0f), t)) & ~rejected;
+}
+
+// The simdIntersectShape function is
+// intersectShape for SIMD_WIDTH rays: the
+// rays are moved into the shape's own space
+// if it has a transform and then tested.
+int simdIntersectShape(const SimdVec3& rayOrigin, const SimdVec3& rayDirection, const Shape& shape, SimdFloat& t) {
+  SimdVec3 localRayOrigin = rayOrigin;
+  SimdVec3 localRayDirection = rayDirection;
+  if (shape.hasTransform) {
+    localRayOrigin = simdTransformPoint(shape.inverseTransform, rayOrigin);
+    localRayDirection = simdTransformDirection(shape.inverseTransform, rayDirection);
+  }
+
+  if (shape.type == Shape::SPHERE) {
+    return simdIntersectSphere(localRayOrigin, localRayDirection, shape.sphere, t);
+  } else if (shape.type == Shape::TRIANGLE) {
+    return simdIntersectTriangle(localRayOrigin, localRayDirection, shape.triangle, t);
+  } else if (shape.type == Shape::PLANE) {
+    return simdIntersectPlane(localRayOrigin, localRayDirection, shape.plane, t);
+  }
+  return 0;
+}
+
+// A RayPacket is a PACKET_SIZE x PACKET_SIZE
+// block of neighbouring camera rays traced
+// together, stored one list per axis so
+// SIMD_WIDTH rays can be loaded at a time.
+// The frustum planes enclose every ray of
+// the packet, which lets the hierarchy skip
+// a box for the whole packet with four
+// plane tests. hitT and hitIndex hold the
+// closest hit found so far for each ray.
+struct RayPacket {
+  float originX[PACKET_RAYS], originY[PACKET_RAYS], originZ[PACKET_RAYS];
+  float directionX[PACKET_RAYS], directionY[PACKET_RAYS], directionZ[PACKET_RAYS];
+  float inverseX[PACKET_RAYS], inverseY[PACKET_RAYS], inverseZ[PACKET_RAYS];
+  float hitT[PACKET_RAYS];
+  float hitIndex[PACKET_RAYS];
+  glm::vec3 frustumPoints[4];
+  glm::vec3 frustumNormals[4];
+
+  void setRay(int ray, const glm::vec3& origin, const glm::vec3& direction) {
+    glm::vec3 inverse = 1.0f / direction;
+    originX[ray] = origin.x;
+    originY[ray] = origin.y;
+    originZ[ray] = origin.z;
+    directionX[ray] = direction.x;
+    directionY[ray] = direction.y;
+    directionZ[ray] = direction.z;
+    inverseX[ray] = inverse.x;
+    inverseY[ray] = inverse.y;
+    inverseZ[ray] = inverse.z;
+    hitT[ray] = std::numeric_limits<float>::infinity();
+    hitIndex[ray] = -1.0f;
+  }
+
+  SimdVec3 origins(int first) const {
+    return SimdVec3(SimdFloat::load(originX + first), SimdFloat::load(originY + first), SimdFloat::load(originZ + first));
+  }
+
+  SimdVec3 directions(int first) const {
+    return SimdVec3(SimdFloat::load(directionX + first), SimdFloat::load(directionY + first), SimdFloat::load(directionZ + first));
+  }
+
+  // The frustum is built from the rays in the
+  // packet's four corners. Each side plane
+  // holds one corner ray and the end of the
+  // next one, which covers perspective rays
+  // (shared origin) and orthographic rays
+  // (shared direction) alike. Every plane is
+  // turned to face the packet's middle ray.
+  void setFrustum(const int corners[4], int middle) {
+    glm::vec3 middlePoint(originX[middle] + directionX[middle], originY[middle] + directionY[middle], originZ[middle] + directionZ[middle]);
+
+    for (int side = 0; side < 4; side++) {
+      int a = corners[side];
+      int b = corners[(side + 1) % 4];
+      glm::vec3 originA(originX[a], originY[a], originZ[a]);
+      glm::vec3 directionA(directionX[a], directionY[a], directionZ[a]);
+      glm::vec3 endB(originX[b] + directionX[b], originY[b] + directionY[b], originZ[b] + directionZ[b]);
+      glm::vec3 normal = glm::cross(directionA, endB - originA);
+
+      if (glm::dot(normal, middlePoint - originA) < 0.0f) normal = -normal;
+      frustumPoints[side] = originA;
+      frustumNormals[side] = normal;
+    }
+  }
+
+  // A box is outside the frustum if its
+  // corner furthest along a plane's normal
+  // is still behind that plane.
+  bool frustumMisses(const glm::vec3& boundsMin, const glm::vec3& boundsMax) const {
+    for (int side = 0; side < 4; side++) {
+      const glm::vec3& normal = frustumNormals[side];
+      glm::vec3 corner(normal.x > 0.0f ? boundsMax.x : boundsMin.x,
+		       normal.y > 0.0f ? boundsMax.y : boundsMin.y,
+		       normal.z > 0.0f ? boundsMax.z : boundsMin.z);
+      if (glm::dot(normal, corner - frustumPoints[side]) < 0.0f) return true;
+    }
+    return false;
+  }
+
+  // The entersBox function is intersectBox for
+  // every ray of the packet, against each
+  // ray's own closest hit. It returns false if
+  // no ray enters the box, and otherwise the
+  // smallest entry distance of those that do.
+  bool entersBox(const glm::vec3& boundsMin, const glm::vec3& boundsMax, float& entryT) const {
+    globalThreadStats.boxTests += PACKET_RAYS;
+    SimdFloat closestEntry(std::numeric_limits<float>::infinity());
+    bool entered = false;
+
+    for (int first = 0; first < PACKET_RAYS; first += SIMD_WIDTH) {
+      SimdFloat t1x = (SimdFloat(boundsMin.x) - SimdFloat::load(originX + first)) * SimdFloat::load(inverseX + first);
+      SimdFloat t1y = (SimdFloat(boundsMin.y) - SimdFloat::load(originY + first)) * SimdFloat::load(inverseY + first);
+      SimdFloat t1z = (SimdFloat(boundsMin.z) - SimdFloat::load(originZ + first)) * SimdFloat::load(inverseZ + first);
+      SimdFloat t2x = (SimdFloat(boundsMax.x) - SimdFloat::load(originX + first)) * SimdFloat::load(inverseX + first);
+      SimdFloat t2y = (SimdFloat(boundsMax.y) - SimdFloat::load(originY + first)) * SimdFloat::load(inverseY + first);
+      SimdFloat t2z = (SimdFloat(boundsMax.z) - SimdFloat::load(originZ + first)) * SimdFloat::load(inverseZ + first);
+
+      SimdFloat entry = simdMax(simdMax(simdMin(t1x, t2x), simdMin(t1y, t2y)), simdMax(simdMin(t1z, t2z), SimdFloat(0.0f)));
+      SimdFloat exit = simdMin(simdMin(simdMax(t1x, t2x), simdMax(t1y, t2y)), simdMin(simdMax(t1z, t2z), SimdFloat::load(hitT + first)));
+      int inside = simdBits(simdLessEqual(entry, exit));
+
+      if (inside) {
+	entered = true;
+	closestEntry = simdMin(closestEntry, simdSelectBits(inside, entry, SimdFloat(std::numeric_limits<float>::infinity())));
+      }
+    }
+
+    if (!entered) return false;
+
+    float entries[SIMD_WIDTH];
+    closestEntry.store(entries);
+    entryT = *std::min_element(entries, entries + SIMD_WIDTH);
+    return true;
+  }
+
+  // The furthestHit function is the largest
+  // closest hit distance in the packet. A box
+  // that every ray enters beyond it can't
+  // hold anything closer.
+  float furthestHit() const {
+    return *std::max_element(hitT, hitT + PACKET_RAYS);
+  }
+
+  // Ties are broken by shape index, the same
+  // way as Bvh::testShape.
+  void testShape(const std::vector<Shape>& shapes, int shapeIndex) {
+    globalThreadStats.intersectionTests += PACKET_RAYS;
+    SimdFloat index(static_cast<float>(shapeIndex));
+
+    for (int first = 0; first < PACKET_RAYS; first += SIMD_WIDTH) {
+      SimdFloat t;
+      int hits = simdIntersectShape(origins(first), directions(first), shapes[shapeIndex], t);
+      if (!hits) continue;
+
+      SimdFloat closestT = SimdFloat::load(hitT + first);
+      SimdFloat closestIndex = SimdFloat::load(hitIndex + first);
+      int closer = hits & (simdBits(simdLess(t, closestT)) |
+			   (simdBits(simdEqual(t, closestT)) & simdBits(simdLess(index, closestIndex))));
+      simdSelectBits(closer, t, closestT).store(hitT + first);
+      simdSelectBits(closer, index, closestIndex).store(hitIndex + first);
+    }
+  }
+};
+
+// The shapeBounds function finds the world
+// space box around a sphere or triangle by
+// transforming the corners of its local box.
+// Planes are infinite and have no bounds.
+void shapeBounds(const Shape& shape, glm::vec3& boundsMin, glm::vec3& boundsMax) {
+  glm::vec3 localMin;
+  glm::vec3 localMax;
+
+  if (shape.type == Shape::SPHERE) {
+    localMin = shape.sphere.center - glm::vec3(shape.sphere.radius);
+    localMax = shape.sphere.center + glm::vec3(shape.sphere.radius);
+  } else {
+    localMin = glm::min(shape.triangle.vertex1, glm::min(shape.triangle.vertex2, shape.triangle.vertex3));
+    localMax = glm::max(shape.triangle.vertex1, glm::max(shape.triangle.vertex2, shape.triangle.vertex3));
+  }
+
+  boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+  boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+  for (int corner = 0; corner < 8; corner++) {
+    glm::vec3 point((corner & 1) ? localMax.x : localMin.x,
+		    (corner & 2) ? localMax.y : localMin.y,
+		    (corner & 4) ? localMax.z : localMin.z);
+    glm::vec3 worldPoint = glm::vec3(shape.getTransform() * glm::vec4(point, 1.0f));
+    boundsMin = glm::min(boundsMin, worldPoint);
+    boundsMax = glm::max(boundsMax, worldPoint);
+  }
+}
+
+// The surfaceArea function is used by the
+// surface area heuristic when building the
+// bounding volume hierarchy.
+float surfaceArea(const glm::vec3& boundsMin, const glm::vec3& boundsMax) {
+  glm::vec3 size = boundsMax - boundsMin;
+  return 2.0f * (size.x * size.y + size.y * size.z + size.z * size.x);
+}
+
+// The intersectBox function is the slab test
+// for an axis aligned box. It returns the
+// distance at which the ray enters the box,
+// as long as that is closer than maxT.
+bool intersectBox(const glm::vec3& rayOrigin, const glm::vec3& inverseDirection, const glm::vec3& boundsMin, const glm::vec3& boundsMax, float maxT, float& entryT) {
+  globalThreadStats.boxTests++;
+  glm::vec3 t1 = (boundsMin - rayOrigin) * inverseDirection;
+  glm::vec3 t2 = (boundsMax - rayOrigin) * inverseDirection;
+  glm::vec3 tNear = glm::min(t1, t2);
+  glm::vec3 tFar = glm::max(t1, t2);
+
+  entryT = glm::max(glm::max(tNear.x, tNear.y), glm::max(tNear.z, 0.0f));
+  float exitT = glm::min(glm::min(tFar.x, tFar.y), glm::min(tFar.z, maxT));
+
+  return entryT <= exitT;
+}
+
+// RayHit holds the closest intersection
+// found for a ray: its distance, world
+// space normal, and the index of the shape.
+struct RayHit {
+  float t;
+  glm::vec3 normal;
+  int index;
+};
+
+// The BvhNode struct is one node of the
+// bounding volume hierarchy. A leaf holds
+// shapeCount shapes starting at first in
+// the hierarchy's shape index list. An inner
+// node has shapeCount 0, and its two
+// children are the nodes first and first + 1.
+struct BvhNode {
+  glm::vec3 boundsMin;
+  glm::vec3 boundsMax;
+  int first;
+  int shapeCount;
+};
+
+// The Bvh struct is a bounding volume
+// hierarchy over the spheres and triangles
+// of a scene, built with the surface area
+// heuristic. Planes are infinite, so they
+// can't be put in a box; they are kept in
+// their own list and tested for every ray.
+// closestHit finds the frontmost shape a ray
+// hits, and anyHit only checks whether
+// anything is hit before a given distance.
+// closestHitPacket is closestHit for a
+// whole packet of camera rays.
+struct Bvh {
+  std::vector<BvhNode> nodes;
+  std::vector<int> shapeIndices;
+  std::vector<int> planeIndices;
+
+  void build(const std::vector<Shape>& shapes) {
+    nodes.clear();
+    shapeIndices.clear();
+    planeIndices.clear();
+
+    std::vector<glm::vec3> boundsMins(shapes.size());
+    std::vector<glm::vec3> boundsMaxs(shapes.size());
+    for (size_t i = 0; i < shapes.size(); i++) {
+      if (shapes[i].type == Shape::PLANE) {
+	planeIndices.push_back(static_cast<int>(i));
+	continue;
+      }
+      shapeBounds(shapes[i], boundsMins[i], boundsMaxs[i]);
+      shapeIndices.push_back(static_cast<int>(i));
+    }
+
+    if (shapeIndices.empty()) return;
+
+    nodes.reserve(2 * shapeIndices.size());
+    nodes.push_back(BvhNode());
+    buildNode(0, 0, static_cast<int>(shapeIndices.size()), 0, boundsMins, boundsMaxs);
+  }
+
+  // Each node is split into two groups by sorting
+  // its shapes' centers into BVH_BINS bins along
+  // every axis and picking the bin boundary with
+  // the lowest surface area cost. If no split is
+  // cheaper than testing every shape, the node
+  // becomes a leaf.
+  void buildNode(int nodeIndex, int first, int count, int depth, const std::vector<glm::vec3>& boundsMins, const std::vector<glm::vec3>& boundsMaxs) {
+    glm::vec3 boundsMin(std::numeric_limits<float>::infinity());
+    glm::vec3 boundsMax(-std::numeric_limits<float>::infinity());
+    glm::vec3 centerMin(std::numeric_limits<float>::infinity());
+    glm::vec3 centerMax(-std::numeric_limits<float>::infinity());
+
+    for (int i = first; i < first + count; i++) {
+      int shapeIndex = shapeIndices[i];
+      glm::vec3 center = 0.5f * (boundsMins[shapeIndex] + boundsMaxs[shapeIndex]);
+      boundsMin = glm::min(boundsMin, boundsMins[shapeIndex]);
+      boundsMax = glm::max(boundsMax, boundsMaxs[shapeIndex]);
+      centerMin = glm::min(centerMin, center);
+      centerMax = glm::max(centerMax, center);
+    }
+
+    nodes[nodeIndex].boundsMin = boundsMin;
+    nodes[nodeIndex].boundsMax = boundsMax;
+    nodes[nodeIndex].first = first;
+    nodes[nodeIndex].shapeCount = count;
+
+    if (count <= 1 || depth >= BVH_MAX_DEPTH) return;
+
+    float bestCost = std::numeric_limits<float>::infinity();
+    int bestAxis = -1;
+    int bestSplit = 0;
+
+    for (int axis = 0; axis < 3; axis++) {
+      float extent = centerMax[axis] - centerMin[axis];
+      if (extent <= 0.0f) continue;
+
+      glm::vec3 binMins[BVH_BINS];
+      glm::vec3 binMaxs[BVH_BINS];
+      int binCounts[BVH_BINS] = {};
+      for (int bin = 0; bin < BVH_BINS; bin++) {
+	binMins[bin] = glm::vec3(std::numeric_limits<float>::infinity());
+	binMaxs[bin] = glm::vec3(-std::numeric_limits<float>::infinity());
+      }
+
+      for (int i = first; i < first + count; i++) {
+	int shapeIndex = shapeIndices[i];
+	int bin = binIndex(0.5f * (boundsMins[shapeIndex][axis] + boundsMaxs[shapeIndex][axis]), centerMin[axis], extent);
+	binMins[bin] = glm::min(binMins[bin], boundsMins[shapeIndex]);
+	binMaxs[bin] = glm::max(binMaxs[bin], boundsMaxs[shapeIndex]);
+	binCounts[bin]++;
+      }
+
+      // Sweep from the right to get the cost of every right
+      // side, then from the left to combine it with each left.
+      float rightCosts[BVH_BINS];
+      glm::vec3 sideMin(std::numeric_limits<float>::infinity());
+      glm::vec3 sideMax(-std::numeric_limits<float>::infinity());
+      int sideCount = 0;
+      for (int bin = BVH_BINS - 1; bin > 0; bin--) {
+	sideMin = glm::min(sideMin, binMins[bin]);
+	sideMax = glm::max(sideMax, binMaxs[bin]);
+	sideCount += binCounts[bin];
+	rightCosts[bin] = sideCount > 0 ? sideCount * surfaceArea(sideMin, sideMax) : 0.0f;
+      }
+
+      sideMin = glm::vec3(std::numeric_limits<float>::infinity());
+      sideMax = glm::vec3(-std::numeric_limits<float>::infinity());
+      sideCount = 0;
+      for (int split = 1; split < BVH_BINS; split++) {
+	sideMin = glm::min(sideMin, binMins[split - 1]);
+	sideMax = glm::max(sideMax, binMaxs[split - 1]);
+	sideCount += binCounts[split - 1];
+	if (sideCount == 0 || sideCount == count) continue;
+
+	float cost = sideCount * surfaceArea(sideMin, sideMax) + rightCosts[split];
+	if (cost < bestCost) {
+	  bestCost = cost;
+	  bestAxis = axis;
+	  bestSplit = split;
+	}
+      }
+    }
+
+    float leafCost = count * surfaceArea(boundsMin, boundsMax);
+    float splitCost = BVH_TRAVERSAL_COST * surfaceArea(boundsMin, boundsMax) + bestCost;
+    if (count <= BVH_LEAF_SIZE && splitCost >= leafCost) return;
+
+    int middle;
+    if (bestAxis >= 0) {
+      float extent = centerMax[bestAxis] - centerMin[bestAxis];
+      middle = static_cast<int>(std::partition(shapeIndices.begin() + first, shapeIndices.begin() + first + count, [&](int shapeIndex) {
+	return binIndex(0.5f * (boundsMins[shapeIndex][bestAxis] + boundsMaxs[shapeIndex][bestAxis]), centerMin[bestAxis], extent) < bestSplit;
+      }) - shapeIndices.begin());
+    } else {
+      // Every center is in the same spot, so any split is as good.
+      middle = first + count / 2;
+    }
+
+    int leftChild = static_cast<int>(nodes.size());
+    nodes.push_back(BvhNode());
+    nodes.push_back(BvhNode());
+    nodes[nodeIndex].first = leftChild;
+    nodes[nodeIndex].shapeCount = 0;
+
+    buildNode(leftChild, first, middle - first, depth + 1, boundsMins, boundsMaxs);
+    buildNode(leftChild + 1, middle, first + count - middle, depth + 1, boundsMins, boundsMaxs);
+  }
+
+  static int binIndex(float center, float centerMin, float extent) {
+    int bin = static_cast<int>(BVH_BINS * (center - centerMin) / extent);
+    return glm::min(glm::max(bin, 0), BVH_BINS - 1);
+  }
+
+  // The refit function updates every box after
+  // shapes have moved, without changing the
+  // tree. Children always come after their
+  // parent, so walking the nodes backwards
+  // updates them bottom up.
+  void refit(const std::vector<Shape>& shapes) {
+    for (int i = static_cast<int>(nodes.size()) - 1; i >= 0; i--) {
+      BvhNode& node = nodes[i];
+
+      if (node.shapeCount > 0) {
+	node.boundsMin = glm::vec3(std::numeric_limits<float>::infinity());
+	node.boundsMax = glm::vec3(-std::numeric_limits<float>::infinity());
+	for (int j = node.first; j < node.first + node.shapeCount; j++) {
+	  glm::vec3 shapeMin;
+	  glm::vec3 shapeMax;
+	  shapeBounds(shapes[shapeIndices[j]], shapeMin, shapeMax);
+	  node.boundsMin = glm::min(node.boundsMin, shapeMin);
+	  node.boundsMax = glm::max(node.boundsMax, shapeMax);
+	}
+      } else {
+	node.boundsMin = glm::min(nodes[node.first].boundsMin, nodes[node.first + 1].boundsMin);
+	node.boundsMax = glm::max(nodes[node.first].boundsMax, nodes[node.first + 1].boundsMax);
+      }
+    }
+  }
+
+  bool closestHit(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const std::vector<Shape>& shapes, RayHit& hit) const {
+    hit.t = std::numeric_limits<float>::infinity();
+    hit.index = -1;
+
+    for (int shapeIndex : planeIndices) {
+      testShape(rayOrigin, rayDirection, shapes, shapeIndex, hit);
+    }
+
+    if (nodes.empty()) return hit.index >= 0;
+
+    glm::vec3 inverseDirection = 1.0f / rayDirection;
+    int stackNodes[BVH_MAX_DEPTH + 4];
+    float stackEntries[BVH_MAX_DEPTH + 4];
+    int stackSize = 0;
+    float entryT;
+
+    if (intersectBox(rayOrigin, inverseDirection, nodes[0].boundsMin, nodes[0].boundsMax, hit.t, entryT)) {
+      stackNodes[stackSize] = 0;
+      stackEntries[stackSize++] = entryT;
+    }
+
+    while (stackSize > 0) {
+      stackSize--;
+      if (stackEntries[stackSize] > hit.t) continue;
+      const BvhNode& node = nodes[stackNodes[stackSize]];
+
+      if (node.shapeCount > 0) {
+	for (int i = node.first; i < node.first + node.shapeCount; i++) {
+	  testShape(rayOrigin, rayDirection, shapes, shapeIndices[i], hit);
+	}
+	continue;
+      }
+
+      float leftEntry = std::numeric_limits<float>::infinity();
+      float rightEntry = std::numeric_limits<float>::infinity();
+      bool hitLeft = intersectBox(rayOrigin, inverseDirection, nodes[node.first].boundsMin, nodes[node.first].boundsMax, hit.t, leftEntry);
+      bool hitRight = intersectBox(rayOrigin, inverseDirection, nodes[node.first + 1].boundsMin, nodes[node.first + 1].boundsMax, hit.t, rightEntry);
+
+      // The nearer child is pushed last so it is searched first.
+      if (hitLeft && hitRight && leftEntry > rightEntry) {
+	stackNodes[stackSize] = node.first;
+	stackEntries[stackSize++] = leftEntry;
+	stackNodes[stackSize] = node.first + 1;
+	stackEntries[stackSize++] = rightEntry;
+      } else {
+	if (hitRight) {
+	  stackNodes[stackSize] = node.first + 1;
+	  stackEntries[stackSize++] = rightEntry;
+	}
+	if (hitLeft) {
+	  stackNodes[stackSize] = node.first;
+	  stackEntries[stackSize++] = leftEntry;
+	}
+      }
+    }
+
+    return hit.index >= 0;
+  }
+
+  // The closestHitPacket function is
+  // closestHit for a whole packet. The packet
+  // walks the tree together: a child is
+  // skipped when it is outside the packet's
+  // frustum or no ray of the packet enters it
+  // before its own closest hit, and a leaf's
+  // shapes are tested against every ray
+  // SIMD_WIDTH rays at a time.
+  void closestHitPacket(RayPacket& packet, const std::vector<Shape>& shapes) const {
+    for (int shapeIndex : planeIndices) {
+      packet.testShape(shapes, shapeIndex);
+    }
+
+    if (nodes.empty()) return;
+
+    int stackNodes[BVH_MAX_DEPTH + 4];
+    float stackEntries[BVH_MAX_DEPTH + 4];
+    int stackSize = 0;
+    float furthestHit = packet.furthestHit();
+    float entryT;
+
+    if (!packet.frustumMisses(nodes[0].boundsMin, nodes[0].boundsMax) &&
+	packet.entersBox(nodes[0].boundsMin, nodes[0].boundsMax, entryT)) {
+      stackNodes[stackSize] = 0;
+      stackEntries[stackSize++] = entryT;
+    }
+
+    while (stackSize > 0) {
+      stackSize--;
+      if (stackEntries[stackSize] > furthestHit) continue;
+      const BvhNode& node = nodes[stackNodes[stackSize]];
+
+      if (node.shapeCount > 0) {
+	for (int i = node.first; i < node.first + node.shapeCount; i++) {
+	  packet.testShape(shapes, shapeIndices[i]);
+	}
+	furthestHit = packet.furthestHit();
+	continue;
+      }
+
+      const BvhNode& left = nodes[node.first];
+      const BvhNode& right = nodes[node.first + 1];
+      float leftEntry = std::numeric_limits<float>::infinity();
+      float rightEntry = std::numeric_limits<float>::infinity();
+      bool hitLeft = !packet.frustumMisses(left.boundsMin, left.boundsMax) && packet.entersBox(left.boundsMin, left.boundsMax, leftEntry);
+      bool hitRight = !packet.frustumMisses(right.boundsMin, right.boundsMax) && packet.entersBox(right.boundsMin, right.boundsMax, rightEntry);
+
+      // The nearer child is pushed last so it is searched first.
+      if (hitLeft && hitRight && leftEntry > rightEntry) {
+	stackNodes[stackSize] = node.first;
+	stackEntries[stackSize++] = leftEntry;
+	stackNodes[stackSize] = node.first + 1;
+	stackEntries[stackSize++] = rightEntry;
+      } else {
+	if (hitRight) {
+	  stackNodes[stackSize] = node.first + 1;
+	  stackEntries[stackSize++] = rightEntry;
+	}
+	if (hitLeft) {
+	  stackNodes[stackSize] = node.first;
+	  stackEntries[stackSize++] = leftEntry;
+	}
+      }
+    }
+  }
+
+  // Ties are broken by shape index so the result doesn't
+  // depend on the order the tree is walked in.
+  static void testShape(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const std::vector<Shape>& shapes, int shapeIndex, RayHit& hit) {
+    globalThreadStats.intersectionTests++;
     float t;
     glm::vec3 normal;
-    if (intersect(localRayOrigin, localRayDirection, shape, t, normal) && t < closestT) {
-      closestT = t;
-      closestNormal = glm::normalize(glm::vec3(glm::transpose(inverseTransform) * glm::vec4(normal, 0.0f)));
-      closestColor = shape.color;
+    if (intersectShape(rayOrigin, rayDirection, shapes[shapeIndex], t, normal) &&
+	(t < hit.t || (t == hit.t && shapeIndex < hit.index))) {
+      hit.t = t;
+      hit.normal = normal;
+      hit.index = shapeIndex;
     }
   }
 
-  if (closestT < std::numeric_limits<float>::infinity()) {
-    return closestColor;
+  bool anyHit(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const std::vector<Shape>& shapes, float maxT) const {
+    float t;
+    glm::vec3 normal;
+
+    for (int shapeIndex : planeIndices) {
+      if (intersectShape(rayOrigin, rayDirection, shapes[shapeIndex], t, normal) && t < maxT) return true;
+    }
+
+    if (nodes.empty()) return false;
+
+    glm::vec3 inverseDirection = 1.0f / rayDirection;
+    int stack[BVH_MAX_DEPTH + 4];
+    int stackSize = 0;
+    float entryT;
+
+    stack[stackSize++] = 0;
+    while (stackSize > 0) {
+      const BvhNode& node = nodes[stack[--stackSize]];
+      if (!intersectBox(rayOrigin, inverseDirection, node.boundsMin, node.boundsMax, maxT, entryT)) continue;
+
+      if (node.shapeCount > 0) {
+	for (int i = node.first; i < node.first + node.shapeCount; i++) {
+	  if (intersectShape(rayOrigin, rayDirection, shapes[shapeIndices[i]], t, normal) && t < maxT) return true;
+	}
+	continue;
+      }
+
+      stack[stackSize++] = node.first + 1;
+      stack[stackSize++] = node.first;
+    }
+
+    return false;
+  }
+};
+
+// The Scene struct holds the shapes read
+// from the scene file together with the
+// bounding volume hierarchy built over them.
+struct Scene {
+  std::vector<Shape> shapes;
+  Bvh bvh;
+};
+
+// This is the traceRay function, which
+// finds the frontmost shape hit by a
+// given ray using the scene's bounding
+// volume hierarchy and returns its color.
+glm::vec3 traceRay(const glm::vec3& rayOrigin, const glm::vec3& rayDirection, const Scene& scene) {
+  RayHit hit;
+  double traceStart = statsClock();
+  bool found = scene.bvh.closestHit(rayOrigin, rayDirection, scene.shapes, hit);
+
+  globalThreadStats.traceSeconds += statsClock() - traceStart;
+  globalThreadStats.cameraRays++;
+  if (found) {
+    globalThreadStats.hits++;
+    return scene.shapes[hit.index].color;
   }
 
   return glm::vec3(0.0f, 0.0f, 0.0f);
@@ -293,13 +1306,14 @@ void applyRotation(std::vector<Shape>& scene, int objectIndex, float angle, cons
 // from its specifications. It goes down
 // every line in the file and performs
 // certain functions based on the given
-// commands.
-void readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
+// commands. It returns false if the file
+// can't be opened.
+bool readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
   std::ifstream file(filename);
 
   if (!file.is_open()) {
-    std::cerr << "Error: Could not open the setup file.\n";
-    return;
+    std::cerr << "Error: Could not open the setup file " << filename << ".\n";
+    return false;
   }
 
   std::string line;
@@ -325,6 +1339,13 @@ void readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
       glm::vec3 up;
       iss >> up.x >> up.y >> up.z;
       globalCameraUp = up;
+    } else if (command == "camera_projection") {
+      std::string projection;
+      iss >> projection;
+      globalCameraOrthographic = (projection == "orthographic");
+      if (globalCameraOrthographic && !(iss >> globalCameraOrthoHalfHeight)) {
+	globalCameraOrthoHalfHeight = 1.0f;
+      }
     }
     else if (command == "sphere") {
       Sphere sphere;
@@ -384,6 +1405,728 @@ void readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
       scene.back().applyTransform(transformMatrix);
     }
   }
+
+  return true;
+}
+
+// The RenderPool struct is a group of worker
+// threads that is started once and then
+// reused for every frame, so the interactive
+// loop doesn't pay for creating threads on
+// each key press. Workers take tiles from a
+// shared counter until none are left, which
+// keeps every thread busy even when some
+// tiles are much slower than others.
+//
+// Frames run in the background: runAsync
+// returns right away, and isDone or wait
+// tell the caller when the frame is ready.
+// cancel stops a frame that is no longer
+// wanted. Workers check for it before each
+// tile, so a cancelled frame ends as soon as
+// the tiles in progress are finished.
+// A frame is only done once every worker
+// has checked in for it, so frameStats
+// holds the whole latest frame and no
+// worker writes to it after that.
+struct RenderPool {
+  std::vector<std::thread> workers;
+  std::mutex mutex;
+  std::condition_variable workReady;
+  std::condition_variable workDone;
+  std::function<void(int)> tileJob;
+  std::atomic<int> nextTile;
+  std::atomic<bool> cancelled;
+  int tileCount = 0;
+  int frame = 0;
+  int checkedIn = 0;
+  bool stopping = false;
+  RenderStats frameStats;
+
+  void start(int threadCount) {
+    nextTile = 0;
+    cancelled = false;
+    checkedIn = threadCount;
+    for (int i = 0; i < threadCount; i++) {
+      workers.emplace_back([this]() { workerLoop(); });
+    }
+  }
+
+  void stop() {
+    cancel();
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    workReady.notify_all();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    workers.clear();
+  }
+
+  ~RenderPool() {
+    stop();
+  }
+
+  void workerLoop() {
+    int seenFrame = 0;
+
+    while (true) {
+      std::unique_lock<std::mutex> lock(mutex);
+      workReady.wait(lock, [&]() { return stopping || frame != seenFrame; });
+      if (stopping) return;
+
+      seenFrame = frame;
+      lock.unlock();
+
+      globalThreadStats = RenderStats();
+      for (int tile = nextTile++; tile < tileCount && !cancelled; tile = nextTile++) {
+	tileJob(tile);
+      }
+
+      lock.lock();
+      frameStats.add(globalThreadStats);
+      if (++checkedIn == static_cast<int>(workers.size())) workDone.notify_all();
+    }
+  }
+
+  // A worker can wake up late for a frame that was
+  // cancelled, so a new frame waits for every worker
+  // to check in before the job is replaced.
+  void runAsync(int count, const std::function<void(int)>& job) {
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      workDone.wait(lock, [&]() { return finished(); });
+      tileJob = job;
+      tileCount = count;
+      nextTile = 0;
+      cancelled = false;
+      frameStats = RenderStats();
+      checkedIn = 0;
+      frame++;
+    }
+    workReady.notify_all();
+  }
+
+  void cancel() {
+    cancelled = true;
+  }
+
+  bool finished() const {
+    return checkedIn == static_cast<int>(workers.size());
+  }
+
+  bool isDone() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished();
+  }
+
+  void wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    workDone.wait(lock, [&]() { return finished(); });
+  }
+};
+
+// The tracePacket function traces the
+// PACKET_SIZE x PACKET_SIZE block of pixels
+// starting at startX, startY as one ray
+// packet. Blocks at the edge of the image
+// are filled out with copies of their first
+// ray, which changes neither the frustum nor
+// any other ray's hit. Only pixels marked in
+// the mask, if one is given, are written.
+void tracePacket(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, int startX, int startY, const std::vector<char>* pixelMask) {
+  int endX = std::min(startX + PACKET_SIZE, globalWidth);
+  int endY = std::min(startY + PACKET_SIZE, globalHeight);
+  bool anyMarked = !pixelMask;
+
+  for (int y = startY; y < endY && !anyMarked; y++) {
+    for (int x = startX; x < endX && !anyMarked; x++) {
+      anyMarked = (*pixelMask)[y * globalWidth + x];
+    }
+  }
+  if (!anyMarked) return;
+
+  double setupStart = statsClock();
+  RayPacket packet;
+  for (int y = startY; y < startY + PACKET_SIZE; y++) {
+    glm::vec3 pixelPoint = camera.pixelPoint(startX, y);
+
+    for (int x = startX; x < startX + PACKET_SIZE; x++, pixelPoint += camera.pixelStepX) {
+      int ray = (y - startY) * PACKET_SIZE + (x - startX);
+      if (x < endX && y < endY) {
+	packet.setRay(ray, camera.rayOrigin(pixelPoint), camera.rayDirection(pixelPoint));
+      } else {
+	packet.setRay(ray, glm::vec3(packet.originX[0], packet.originY[0], packet.originZ[0]),
+		      glm::vec3(packet.directionX[0], packet.directionY[0], packet.directionZ[0]));
+      }
+    }
+  }
+
+  int lastX = endX - 1 - startX;
+  int lastY = (endY - 1 - startY) * PACKET_SIZE;
+  int corners[4] = { 0, lastX, lastY + lastX, lastY };
+  packet.setFrustum(corners, (lastY / PACKET_SIZE / 2) * PACKET_SIZE + lastX / 2);
+
+  double traceStart = statsClock();
+  scene.bvh.closestHitPacket(packet, scene.shapes);
+  double writeStart = statsClock();
+
+  for (int y = startY; y < endY; y++) {
+    for (int x = startX; x < endX; x++) {
+      if (pixelMask && !(*pixelMask)[y * globalWidth + x]) continue;
+
+      int index = static_cast<int>(packet.hitIndex[(y - startY) * PACKET_SIZE + (x - startX)]);
+      glm::vec3 color = index >= 0 ? scene.shapes[index].color : glm::vec3(0.0f, 0.0f, 0.0f);
+
+      image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
+      image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
+      image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+      globalThreadStats.cameraRays++;
+      if (index >= 0) globalThreadStats.hits++;
+    }
+  }
+
+  globalThreadStats.setupSeconds += traceStart - setupStart;
+  globalThreadStats.traceSeconds += writeStart - traceStart;
+  globalThreadStats.writeSeconds += statsClock() - writeStart;
+}
+
+// The renderTile function traces one ray
+// through every pixel of a TILE_SIZE x
+// TILE_SIZE tile. The camera's pixel point
+// is stepped along each row, so no matrix
+// work is done per pixel. If a pixel mask
+// is given, only the marked pixels are
+// traced and the rest are left as they are.
+// With packet tracing on, the tile is
+// traced as PACKET_SIZE x PACKET_SIZE ray
+// packets instead.
+void renderTile(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, int tile, const std::vector<char>* pixelMask = nullptr) {
+  int tilesX = (globalWidth + TILE_SIZE - 1) / TILE_SIZE;
+  int startX = (tile % tilesX) * TILE_SIZE;
+  int startY = (tile / tilesX) * TILE_SIZE;
+  int endX = std::min(startX + TILE_SIZE, globalWidth);
+  int endY = std::min(startY + TILE_SIZE, globalHeight);
+
+  if (globalPacketTracing) {
+    for (int y = startY; y < endY; y += PACKET_SIZE) {
+      for (int x = startX; x < endX; x += PACKET_SIZE) {
+	tracePacket(image, scene, camera, x, y, pixelMask);
+      }
+    }
+    return;
+  }
+
+  for (int y = startY; y < endY; y++) {
+    glm::vec3 pixelPoint = camera.pixelPoint(startX, y);
+
+    for (int x = startX; x < endX; x++, pixelPoint += camera.pixelStepX) {
+      if (pixelMask && !(*pixelMask)[y * globalWidth + x]) continue;
+
+      glm::vec3 color = traceRay(camera.rayOrigin(pixelPoint), camera.rayDirection(pixelPoint), scene);
+
+      image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
+      image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
+      image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+    }
+  }
+}
+
+// The startImage function starts rendering
+// the whole image on the render pool, one
+// tile at a time, and returns right away.
+// Every pixel belongs to one tile, so the
+// threads never write to the same place.
+// The scene must not change until the pool
+// is done or has been cancelled.
+void startImage(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, RenderPool& pool) {
+  int tilesX = (globalWidth + TILE_SIZE - 1) / TILE_SIZE;
+  int tilesY = (globalHeight + TILE_SIZE - 1) / TILE_SIZE;
+
+  pool.runAsync(tilesX * tilesY, [&image, &scene, &camera](int tile) {
+    renderTile(image, scene, camera, tile);
+  });
+}
+
+// The renderImage function renders the whole
+// image and waits for it to finish.
+void renderImage(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, RenderPool& pool) {
+  startImage(image, scene, camera, pool);
+  pool.wait();
+}
+
+// The ScreenRect struct is a box of pixels,
+// from minX, minY to maxX, maxY inclusive.
+struct ScreenRect {
+  int minX;
+  int minY;
+  int maxX;
+  int maxY;
+};
+
+// The DirtyRegion struct keeps track of the
+// pixels that have to be traced again after
+// shapes move. Rectangles are marked
+// straight into the pixel mask and the list
+// of tiles they touch, so neither marking
+// nor starting a frame looks at the rest of
+// the screen, and clear only resets the
+// tiles that were marked.
+struct DirtyRegion {
+  std::vector<char> pixels;
+  std::vector<char> tileMarked;
+  std::vector<int> tiles;
+
+  void resize(int width, int height) {
+    int tilesX = (width + TILE_SIZE - 1) / TILE_SIZE;
+    int tilesY = (height + TILE_SIZE - 1) / TILE_SIZE;
+    pixels.assign(width * height, 0);
+    tileMarked.assign(tilesX * tilesY, 0);
+    tiles.clear();
+  }
+
+  void mark(const ScreenRect& rect) {
+    int tilesX = (globalWidth + TILE_SIZE - 1) / TILE_SIZE;
+
+    for (int y = rect.minY; y <= rect.maxY; y++) {
+      std::fill(pixels.begin() + y * globalWidth + rect.minX, pixels.begin() + y * globalWidth + rect.maxX + 1, 1);
+    }
+    for (int tileY = rect.minY / TILE_SIZE; tileY <= rect.maxY / TILE_SIZE; tileY++) {
+      for (int tileX = rect.minX / TILE_SIZE; tileX <= rect.maxX / TILE_SIZE; tileX++) {
+	int tile = tileY * tilesX + tileX;
+	if (!tileMarked[tile]) tiles.push_back(tile);
+	tileMarked[tile] = 1;
+      }
+    }
+  }
+
+  void clear() {
+    int tilesX = (globalWidth + TILE_SIZE - 1) / TILE_SIZE;
+
+    for (int tile : tiles) {
+      int startX = (tile % tilesX) * TILE_SIZE;
+      int startY = (tile / tilesX) * TILE_SIZE;
+      int endX = std::min(startX + TILE_SIZE, globalWidth);
+      int endY = std::min(startY + TILE_SIZE, globalHeight);
+
+      for (int y = startY; y < endY; y++) {
+	std::fill(pixels.begin() + y * globalWidth + startX, pixels.begin() + y * globalWidth + endX, 0);
+      }
+      tileMarked[tile] = 0;
+    }
+    tiles.clear();
+  }
+};
+
+// The startRegion function is like
+// startImage, but only traces the tiles
+// and pixels marked in region. The region
+// must not change until the pool is done
+// or has been cancelled.
+void startRegion(CImg<unsigned char>& image, const Scene& scene, const Camera& camera, RenderPool& pool, const DirtyRegion& region) {
+  pool.runAsync(static_cast<int>(region.tiles.size()), [&image, &scene, &camera, &region](int i) {
+    renderTile(image, scene, camera, region.tiles[i], &region.pixels);
+  });
+}
+
+// The footprint function finds the pixels
+// whose ray could hit a shape. The corners
+// of the shape's bounds are projected to
+// the screen and the box around them, plus
+// a pixel of margin, is returned. Planes,
+// and shapes that reach behind the camera,
+// cover the whole screen.
+ScreenRect footprint(const Shape& shape, const Camera& camera) {
+  ScreenRect rect = { 0, 0, globalWidth - 1, globalHeight - 1 };
+
+  if (shape.type != Shape::PLANE) {
+    glm::vec3 boundsMin;
+    glm::vec3 boundsMax;
+    shapeBounds(shape, boundsMin, boundsMax);
+
+    float screenMinX = std::numeric_limits<float>::infinity();
+    float screenMinY = std::numeric_limits<float>::infinity();
+    float screenMaxX = -std::numeric_limits<float>::infinity();
+    float screenMaxY = -std::numeric_limits<float>::infinity();
+    bool visible = true;
+
+    for (int corner = 0; corner < 8 && visible; corner++) {
+      glm::vec3 point((corner & 1) ? boundsMax.x : boundsMin.x,
+		      (corner & 2) ? boundsMax.y : boundsMin.y,
+		      (corner & 4) ? boundsMax.z : boundsMin.z);
+      float x;
+      float y;
+      visible = camera.project(point, x, y);
+      screenMinX = glm::min(screenMinX, x);
+      screenMinY = glm::min(screenMinY, y);
+      screenMaxX = glm::max(screenMaxX, x);
+      screenMaxY = glm::max(screenMaxY, y);
+    }
+
+    // A corner just in front of the camera
+    // projects far off screen, so the bounds
+    // are clamped to the image before they
+    // become ints. NaN fails every compare and
+    // keeps the whole screen.
+    if (visible && screenMinX <= screenMaxX && screenMinY <= screenMaxY) {
+      screenMinX = glm::clamp(screenMinX, -1.0f, static_cast<float>(globalWidth));
+      screenMinY = glm::clamp(screenMinY, -1.0f, static_cast<float>(globalHeight));
+      screenMaxX = glm::clamp(screenMaxX, -1.0f, static_cast<float>(globalWidth));
+      screenMaxY = glm::clamp(screenMaxY, -1.0f, static_cast<float>(globalHeight));
+      rect.minX = glm::max(rect.minX, static_cast<int>(std::floor(screenMinX)) - 1);
+      rect.minY = glm::max(rect.minY, static_cast<int>(std::floor(screenMinY)) - 1);
+      rect.maxX = glm::min(rect.maxX, static_cast<int>(std::ceil(screenMaxX)) + 1);
+      rect.maxY = glm::min(rect.maxY, static_cast<int>(std::ceil(screenMaxY)) + 1);
+    }
+  }
+  return rect;
+}
+
+// The collectHierarchy function lists an
+// object and every child under it, which
+// are the shapes a key press moves.
+void collectHierarchy(const std::vector<Shape>& scene, int objectIndex, std::vector<int>& indices) {
+  indices.push_back(objectIndex);
+
+  for (int childIndex : scene[objectIndex].children) {
+    collectHierarchy(scene, childIndex, indices);
+  }
+}
+
+// The applyKey function moves or turns the
+// main object for one key press. It returns
+// false for keys that don't do anything.
+bool applyKey(std::vector<Shape>& scene, unsigned int key) {
+  switch (key) {
+    case cimg_library::cimg::keyARROWLEFT:
+      applyTranslation(scene, 0, glm::vec3(0.5f, 0.0f, 0.0f));
+      return true;
+    case cimg_library::cimg::keyARROWRIGHT:
+      applyTranslation(scene, 0, glm::vec3(-0.5f, 0.0f, 0.0f));
+      return true;
+    case cimg_library::cimg::keyARROWUP:
+      applyTranslation(scene, 0, glm::vec3(0.0f, 0.0f, -0.5f));
+      return true;
+    case cimg_library::cimg::keyARROWDOWN:
+      applyTranslation(scene, 0, glm::vec3(0.0f, 0.0f, 0.5f));
+      return true;
+    case cimg_library::cimg::keyQ:
+      applyRotation(scene, 0, 20.0, glm::vec3(0.0f, 1.0f, 0.0f));
+      return true;
+    case cimg_library::cimg::keyE:
+      applyRotation(scene, 0, -20.0, glm::vec3(0.0f, 1.0f, 0.0f));
+      return true;
+  }
+  return false;
+}
+
+// The imageFormat function works out which
+// format a batch render is saved in: the
+// one given with --format, or else the
+// output file's extension. It returns an
+// empty string for anything other than
+// png, ppm or pfm.
+std::string imageFormat(const std::string& outputPath, std::string format) {
+  if (format.empty()) {
+    size_t dot = outputPath.find_last_of('.');
+    if (dot != std::string::npos) format = outputPath.substr(dot + 1);
+  }
+  std::transform(format.begin(), format.end(), format.begin(), [](unsigned char c) { return std::tolower(c); });
+
+  if (format == "png" || format == "ppm" || format == "pfm") return format;
+  return "";
+}
+
+// The saveImage function writes a finished
+// batch render to a file. PFM files hold
+// floats, so the colors are scaled back to
+// the 0 to 1 range first. It returns false
+// if the file can't be written.
+bool saveImage(const CImg<unsigned char>& image, const std::string& outputPath, const std::string& format) {
+  try {
+    if (format == "png") {
+      image.save_png(outputPath.c_str());
+    } else if (format == "ppm") {
+      image.save_pnm(outputPath.c_str());
+    } else {
+      (CImg<float>(image) / 255.0f).save_pfm(outputPath.c_str());
+    }
+  }
+  catch (const CImgException& error) {
+    std::cerr << "Error: Could not write " << outputPath << ": " << error.what() << "\n";
+    return false;
+  }
+  return true;
+}
+
+// The writeStats function saves a --stats
+// report for the first frame as JSON. The
+// stage times are wall clock seconds, and
+// threadSeconds splits the render's time,
+// summed over all threads, by what the
+// threads were doing. It returns false if
+// the file can't be written.
+bool writeStats(const std::string& statsPath, const std::string& scenePath, const Scene& scene, int threadCount,
+		const RenderStats& stats, double parseSeconds, double buildSeconds, double renderSeconds,
+		double saveSeconds, double totalSeconds) {
+  std::ofstream file(statsPath);
+  if (!file.is_open()) {
+    std::cerr << "Error: Could not write the stats file " << statsPath << "." << std::endl;
+    return false;
+  }
+
+  auto perRay = [](long long count, long long rays) { return rays > 0 ? static_cast<double>(count) / rays : 0.0; };
+  std::string sceneName;
+  for (char c : scenePath) {
+    if (c == '"' || c == '\\') sceneName += '\\';
+    sceneName += c;
+  }
+
+  file << std::setprecision(6);
+  file << "{\n";
+  file << "  \"renderer\": \"rayTracer\",\n";
+  file << "  \"scene\": \"" << sceneName << "\",\n";
+  file << "  \"width\": " << globalWidth << ",\n";
+  file << "  \"height\": " << globalHeight << ",\n";
+  file << "  \"threads\": " << threadCount << ",\n";
+  file << "  \"mode\": \"" << (globalPacketTracing ? "packet" : "scalar") << "\",\n";
+  file << "  \"shapes\": " << scene.shapes.size() << ",\n";
+  file << "  \"stages\": {\n";
+  file << "    \"parse\": " << parseSeconds << ",\n";
+  file << "    \"build\": " << buildSeconds << ",\n";
+  file << "    \"render\": " << renderSeconds << ",\n";
+  file << "    \"save\": " << saveSeconds << ",\n";
+  file << "    \"total\": " << totalSeconds << "\n";
+  file << "  },\n";
+  file << "  \"threadSeconds\": {\n";
+  file << "    \"setup\": " << stats.setupSeconds << ",\n";
+  file << "    \"trace\": " << stats.traceSeconds << ",\n";
+  file << "    \"write\": " << stats.writeSeconds << "\n";
+  file << "  },\n";
+  file << "  \"cameraRays\": " << stats.cameraRays << ",\n";
+  file << "  \"raysPerSecond\": " << (renderSeconds > 0.0 ? stats.cameraRays / renderSeconds : 0.0) << ",\n";
+  file << "  \"hits\": " << stats.hits << ",\n";
+  file << "  \"intersectionTests\": " << stats.intersectionTests << ",\n";
+  file << "  \"intersectionTestsPerRay\": " << perRay(stats.intersectionTests, stats.cameraRays) << ",\n";
+  file << "  \"boxTests\": " << stats.boxTests << ",\n";
+  file << "  \"boxTestsPerRay\": " << perRay(stats.boxTests, stats.cameraRays) << "\n";
+  file << "}\n";
+  return true;
+}
+
+// The timeKernel function times a benchmark
+// kernel that does opsPerCall operations per
+// call. The kernel is called over and over
+// for BENCH_RUN_SECONDS, BENCH_RUNS times,
+// and the fastest run's nanoseconds per
+// operation is returned, since anything
+// slower than that was noise from the rest
+// of the machine.
+template <typename Kernel>
+double timeKernel(Kernel kernel, long long opsPerCall) {
+  double best = std::numeric_limits<double>::infinity();
+
+  for (int run = 0; run < BENCH_RUNS; run++) {
+    auto start = std::chrono::steady_clock::now();
+    double elapsed = 0.0;
+    long long calls = 0;
+
+    while (elapsed < BENCH_RUN_SECONDS) {
+      kernel();
+      calls++;
+      elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+    best = std::min(best, elapsed * 1e9 / (calls * opsPerCall));
+  }
+  return best;
+}
+
+// The runKernelBenchmarks function times the
+// scalar intersection functions against
+// their SIMD versions over BENCH_OPS random
+// rays, and prints the nanoseconds per ray
+// and millions of rays per second for each.
+// Like the packets, every group of
+// BENCH_RAYS_PER_SHAPE rays is tested
+// against the same shape. The same seed is
+// used every time, so every run measures the
+// same work. The SIMD kernels must agree
+// with the scalar ones on every hit, and on
+// its distance to within BENCH_MAX_ERROR. If
+// a baseline file is given, any kernel more
+// than driftPercent slower than its baseline
+// time fails the run. The file has one
+// "name nanoseconds" line per kernel, as
+// written by --save-baseline. It returns the
+// exit code.
+int runKernelBenchmarks(const std::string& baselinePath, const std::string& savePath, double driftPercent) {
+  std::map<std::string, double> baseline;
+  if (!baselinePath.empty()) {
+    std::ifstream file(baselinePath);
+    if (!file.is_open()) {
+      std::cerr << "Error: Could not open the baseline file " << baselinePath << "." << std::endl;
+      return 1;
+    }
+    std::string name;
+    double nanoseconds;
+    while (file >> name >> nanoseconds) {
+      baseline[name] = nanoseconds;
+    }
+  }
+
+  std::mt19937 random(42);
+  std::uniform_real_distribution<float> coordinate(-1.0f, 1.0f);
+  std::uniform_real_distribution<float> size(0.2f, 1.0f);
+  auto randomPoint = [&](float scale) {
+    float x = coordinate(random);
+    float y = coordinate(random);
+    float z = coordinate(random);
+    return glm::vec3(x, y, z) * scale;
+  };
+
+  // Rays start around the shapes and aim at
+  // a random point among them, so that some
+  // hit and some miss.
+  std::vector<glm::vec3> origins;
+  std::vector<glm::vec3> directions;
+  std::vector<float> originX, originY, originZ;
+  std::vector<float> directionX, directionY, directionZ;
+  for (int i = 0; i < BENCH_OPS; i++) {
+    origins.push_back(randomPoint(5.0f));
+    directions.push_back(glm::normalize(randomPoint(1.0f) - origins.back()));
+    originX.push_back(origins.back().x);
+    originY.push_back(origins.back().y);
+    originZ.push_back(origins.back().z);
+    directionX.push_back(directions.back().x);
+    directionY.push_back(directions.back().y);
+    directionZ.push_back(directions.back().z);
+  }
+  auto loadRays = [&](int first, SimdVec3& origin, SimdVec3& direction) {
+    origin = SimdVec3(SimdFloat::load(&originX[first]), SimdFloat::load(&originY[first]), SimdFloat::load(&originZ[first]));
+    direction = SimdVec3(SimdFloat::load(&directionX[first]), SimdFloat::load(&directionY[first]), SimdFloat::load(&directionZ[first]));
+  };
+
+  std::vector<Sphere> spheres;
+  std::vector<Triangle> triangles;
+  std::vector<Plane> planes;
+  for (int i = 0; i < BENCH_OPS / BENCH_RAYS_PER_SHAPE; i++) {
+    spheres.push_back({ randomPoint(1.0f), size(random), glm::vec3(1.0f) });
+    triangles.push_back({ randomPoint(1.0f), randomPoint(1.0f), randomPoint(1.0f), glm::vec3(1.0f) });
+    planes.push_back({ randomPoint(1.0f), glm::normalize(randomPoint(1.0f)), glm::vec3(1.0f) });
+  }
+
+  // A miss is stored as an infinite distance.
+  std::vector<float> scalarResults(BENCH_OPS);
+  std::vector<float> simdResults(BENCH_OPS);
+  std::vector<std::pair<std::string, double>> timings;
+  const float miss = std::numeric_limits<float>::infinity();
+  bool passed = true;
+
+  auto benchmark = [&](const std::string& name, auto scalarKernel, auto simdKernel) {
+    timings.push_back({ name, timeKernel(scalarKernel, BENCH_OPS) });
+    timings.push_back({ "simd" + std::string(1, static_cast<char>(std::toupper(name[0]))) + name.substr(1),
+			timeKernel(simdKernel, BENCH_OPS) });
+
+    int mismatches = 0;
+    float maxError = 0.0f;
+    for (int i = 0; i < BENCH_OPS; i++) {
+      if ((scalarResults[i] == miss) != (simdResults[i] == miss)) {
+	mismatches++;
+      } else if (scalarResults[i] != miss) {
+	maxError = std::max(maxError, std::fabs(scalarResults[i] - simdResults[i]) / std::max(1.0f, std::fabs(scalarResults[i])));
+      }
+    }
+    if (mismatches > 0 || !(maxError <= BENCH_MAX_ERROR)) {
+      std::cerr << "Error: " << timings.back().first << " differs from " << name << " on " << mismatches
+		<< " hits, and by up to " << maxError << " in distance." << std::endl;
+      passed = false;
+    }
+  };
+
+  benchmark("intersectSphere", [&]() {
+    for (int i = 0; i < BENCH_OPS; i++) {
+      float t;
+      glm::vec3 normal;
+      bool hit = intersectSphere(origins[i], directions[i], spheres[i / BENCH_RAYS_PER_SHAPE], t, normal);
+      scalarResults[i] = hit ? t : miss;
+    }
+  }, [&]() {
+    for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+      SimdVec3 origin, direction;
+      SimdFloat t;
+      loadRays(i, origin, direction);
+      int hits = simdIntersectSphere(origin, direction, spheres[i / BENCH_RAYS_PER_SHAPE], t);
+      simdSelectBits(hits, t, SimdFloat(miss)).store(&simdResults[i]);
+    }
+  });
+  benchmark("intersectTriangle", [&]() {
+    for (int i = 0; i < BENCH_OPS; i++) {
+      float t;
+      glm::vec3 normal;
+      bool hit = intersectTriangle(origins[i], directions[i], triangles[i / BENCH_RAYS_PER_SHAPE], t, normal);
+      scalarResults[i] = hit ? t : miss;
+    }
+  }, [&]() {
+    for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+      SimdVec3 origin, direction;
+      SimdFloat t;
+      loadRays(i, origin, direction);
+      int hits = simdIntersectTriangle(origin, direction, triangles[i / BENCH_RAYS_PER_SHAPE], t);
+      simdSelectBits(hits, t, SimdFloat(miss)).store(&simdResults[i]);
+    }
+  });
+  benchmark("intersectPlane", [&]() {
+    for (int i = 0; i < BENCH_OPS; i++) {
+      float t;
+      glm::vec3 normal;
+      bool hit = intersectPlane(origins[i], directions[i], planes[i / BENCH_RAYS_PER_SHAPE], t, normal);
+      scalarResults[i] = hit ? t : miss;
+    }
+  }, [&]() {
+    for (int i = 0; i < BENCH_OPS; i += SIMD_WIDTH) {
+      SimdVec3 origin, direction;
+      SimdFloat t;
+      loadRays(i, origin, direction);
+      int hits = simdIntersectPlane(origin, direction, planes[i / BENCH_RAYS_PER_SHAPE], t);
+      simdSelectBits(hits, t, SimdFloat(miss)).store(&simdResults[i]);
+    }
+  });
+
+  std::cout << std::left << std::setw(30) << "kernel" << std::right << std::setw(10) << "ns/op"
+	    << std::setw(12) << "Mops/s" << std::setw(12) << "baseline" << std::setw(10) << "change" << "\n";
+  std::cout << std::fixed;
+  for (const auto& timing : timings) {
+    std::cout << std::left << std::setw(30) << timing.first << std::right << std::setprecision(3)
+	      << std::setw(10) << timing.second << std::setprecision(1) << std::setw(12) << 1000.0 / timing.second;
+
+    auto stored = baseline.find(timing.first);
+    if (stored != baseline.end()) {
+      double change = (timing.second / stored->second - 1.0) * 100.0;
+      std::cout << std::setprecision(3) << std::setw(12) << stored->second << std::setprecision(1)
+		<< std::setw(9) << std::showpos << change << std::noshowpos << "%";
+      if (change > driftPercent) {
+	std::cout << "  slower than the baseline";
+	passed = false;
+      }
+    }
+    std::cout << "\n";
+  }
+  std::cout << std::defaultfloat;
+
+  if (!savePath.empty()) {
+    std::ofstream file(savePath);
+    if (!file.is_open()) {
+      std::cerr << "Error: Could not write the baseline file " << savePath << "." << std::endl;
+      return 1;
+    }
+    for (const auto& timing : timings) {
+      file << timing.first << " " << timing.second << "\n";
+    }
+  }
+
+  return passed ? 0 : 1;
 }
 
 // The main function, as usual, is where
@@ -395,89 +2138,220 @@ void readSetupFile(const std::string& filename, std::vector<Shape>& scene) {
 // to let the user make any number of
 // alterations to the shape (translation
 // and rotation) until they close the window.
-int main() {
-  std::vector<Shape> originalScene;
-  std::vector<Shape> scene;
-  readSetupFile("scene.txt", scene);
+// The optional arguments are:
+//
+// -t, --threads N       threads to render with
+// --scalar              trace one ray at a time
+//                       instead of in packets
+// -s, --scene FILE      scene file (scene.txt)
+// -o, --output FILE     save the first frame to FILE
+//                       and exit instead of opening
+//                       a window
+// -f, --format FORMAT   png, ppm or pfm (taken from
+//                       the output file's extension
+//                       by default)
+// --stats FILE          write counters and timings
+//                       for the first frame to FILE
+//                       as JSON
+// --bench               time the intersection
+//                       functions instead of
+//                       rendering (see
+//                       runKernelBenchmarks)
+// --baseline FILE       fail the benchmark if a
+//                       kernel is slower than in FILE
+// --save-baseline FILE  save the benchmark times
+// --drift PERCENT       how much slower is allowed (10)
+//
+// ./a -t 8 -s scene.txt -o frame.png
+//
+// By default one thread is used for every
+// core on the machine, and packets are used
+// whenever AVX2 is available. With --output
+// no window is opened, so it can run on
+// machines with no screen; building with
+// -Dcimg_display=0 also drops the need for
+// X11. The exit code is 0 on success and 1
+// if the scene couldn't be read or the image
+// couldn't be written.
+int main(int argc, char* argv[]) {
+  int threadCount = static_cast<int>(std::thread::hardware_concurrency());
+  std::string scenePath = "scene.txt";
+  std::string outputPath;
+  std::string format;
+  std::string statsPath;
+  bool benchmark = false;
+  std::string baselinePath;
+  std::string saveBaselinePath;
+  double driftPercent = 10.0;
+  auto programStart = std::chrono::steady_clock::now();
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if ((arg == "-t" || arg == "--threads") && i + 1 < argc) {
+      threadCount = std::atoi(argv[++i]);
+    }
+    else if (arg == "--scalar") {
+      globalPacketTracing = false;
+    }
+    else if ((arg == "-s" || arg == "--scene") && i + 1 < argc) {
+      scenePath = argv[++i];
+    }
+    else if ((arg == "-o" || arg == "--output") && i + 1 < argc) {
+      outputPath = argv[++i];
+    }
+    else if ((arg == "-f" || arg == "--format") && i + 1 < argc) {
+      format = argv[++i];
+    }
+    else if (arg == "--stats" && i + 1 < argc) {
+      statsPath = argv[++i];
+      globalCollectStats = true;
+    }
+    else if (arg == "--bench") {
+      benchmark = true;
+    }
+    else if (arg == "--baseline" && i + 1 < argc) {
+      baselinePath = argv[++i];
+    }
+    else if (arg == "--save-baseline" && i + 1 < argc) {
+      saveBaselinePath = argv[++i];
+    }
+    else if (arg == "--drift" && i + 1 < argc) {
+      driftPercent = std::atof(argv[++i]);
+    }
+    else {
+      std::cerr << "Usage: " << argv[0] << " [-t threads] [--scalar] [-s scene.txt] [-o output] [-f png|ppm|pfm] [--stats stats.json]\n"
+		<< "       " << argv[0] << " --bench [--baseline file] [--save-baseline file] [--drift percent]\n";
+      return 1;
+    }
+  }
+  if (threadCount < 1) threadCount = 1;
+
+  if (benchmark) {
+    return runKernelBenchmarks(baselinePath, saveBaselinePath, driftPercent);
+  }
+
+  if (!outputPath.empty()) {
+    // saveImage reports write errors itself.
+    cimg::exception_mode(0);
+    format = imageFormat(outputPath, format);
+    if (format.empty()) {
+      std::cerr << "Error: The output format must be png, ppm or pfm.\n";
+      return 1;
+    }
+  }
+
+  Scene scene;
+  if (!readSetupFile(scenePath, scene.shapes)) {
+    return 1;
+  }
+  if (globalWidth <= 0 || globalHeight <= 0) {
+    std::cerr << "Error: The setup file has no image size.\n";
+    return 1;
+  }
+  auto parseEnd = std::chrono::steady_clock::now();
+  scene.bvh.build(scene.shapes);
+  auto buildEnd = std::chrono::steady_clock::now();
 
   const int width = globalWidth;
   const int height = globalHeight;
 
   CImg<unsigned char> image(width, height, 1, 3, 0);
-  CImgDisplay display(image, "Ray Tracing");
 
-  glm::mat4 viewMatrix = glm::lookAt(globalCameraPosition, globalCameraTarget, globalCameraUp);
+  Camera camera;
+  camera.setup(globalCameraPosition, globalCameraTarget, globalCameraUp, width, height,
+	       globalCameraOrthographic ? Camera::ORTHOGRAPHIC : Camera::PERSPECTIVE, globalCameraOrthoHalfHeight);
 
-  float aspectRatio = static_cast<float>(width) / height;
+  RenderPool pool;
+  pool.start(threadCount);
 
-  for (int y = 0; y < height; y++) {
-    for (int x = 0; x < width; x++) {
-      float ndcX = aspectRatio * ((2.0f * x) / width - 1.0f);
-      float ndcY = 1.0f - (2.0f * y) / height;
-      glm::vec4 clipCoords(ndcX, ndcY, -1.0f, 1.0f);
-      glm::vec4 eyeCoords = glm::inverse(viewMatrix) * clipCoords;
-      glm::vec3 rayDirection = -glm::normalize(glm::vec3(eyeCoords));
+  renderImage(image, scene, camera, pool);
+  auto renderEnd = std::chrono::steady_clock::now();
 
-      glm::vec3 color = traceRay(globalCameraPosition, rayDirection, scene);
+  bool saved = outputPath.empty() || saveImage(image, outputPath, format);
+  auto saveEnd = std::chrono::steady_clock::now();
 
-      image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
-      image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
-      image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+  if (!statsPath.empty()) {
+    auto seconds = [](std::chrono::steady_clock::time_point a, std::chrono::steady_clock::time_point b) {
+      return std::chrono::duration<double>(b - a).count();
+    };
+    if (!writeStats(statsPath, scenePath, scene, threadCount, pool.frameStats, seconds(programStart, parseEnd),
+		    seconds(parseEnd, buildEnd), seconds(buildEnd, renderEnd), seconds(renderEnd, saveEnd),
+		    seconds(programStart, saveEnd))) {
+      return 1;
     }
   }
-      
+  if (!outputPath.empty()) {
+    return saved ? 0 : 1;
+  }
+
+  CImgDisplay display(image, "Ray Tracing");
   display.render(image);
   display.paint();
 
-  glm::vec3 originalPosition = scene[0].sphere.center;
-  
+  // The display keeps a history of key presses with the
+  // newest first and a 0 for every release. It is cleared
+  // after each batch, so every key left in it is new and
+  // they are replayed oldest first. Any keys pressed while
+  // a frame is drawing cancel it and are folded into one
+  // new frame.
+  //
+  // Only the pixels the moved shapes covered before or
+  // cover now can change, so only those are traced again.
+  // A cancelled frame may have left some of them half
+  // drawn, so they stay marked until a frame finishes.
+  DirtyRegion dirtyRegion;
+  dirtyRegion.resize(width, height);
+  std::vector<ScreenRect> oldFootprints;
+  std::vector<int> movedShapes;
+  collectHierarchy(scene.shapes, 0, movedShapes);
+  bool framePending = false;
+
   while (!display.is_closed()) {
-    if (display.key()) {
-      Shape& object = scene[0];
-
-      switch (display.key()) {
-        case cimg_library::cimg::keyARROWLEFT:
-	  applyTranslation(scene, 0, glm::vec3(0.5f, 0.0f, 0.0f));
-	  break;
-	case cimg_library::cimg::keyARROWRIGHT:
-	  applyTranslation(scene, 0, glm::vec3(-0.5f, 0.0f, 0.0f));
-	  break;
-	case cimg_library::cimg::keyARROWUP:
-	  applyTranslation(scene, 0, glm::vec3(0.0f, 0.0f, -0.5f));
-	  break;
-	case cimg_library::cimg::keyARROWDOWN:
-	  applyTranslation(scene, 0, glm::vec3(0.0f, 0.0f, 0.5f));
-	  break;
-        case cimg_library::cimg::keyQ:
-	  applyRotation(scene, 0, 20.0, glm::vec3(0.0f, 1.0f, 0.0f));
-	  break;
-        case cimg_library::cimg::keyE:
-	  applyRotation(scene, 0, -20.0, glm::vec3(0.0f, 1.0f, 0.0f));
-	  break;
+    std::vector<unsigned int> keys;
+    for (int i = 127; i >= 0; i--) {
+      if (display.key(i)) keys.push_back(display.key(i));
+    }
+    display.set_key();
+
+    if (!keys.empty()) {
+      pool.cancel();
+      pool.wait();
+
+      oldFootprints.clear();
+      for (int shapeIndex : movedShapes) {
+	oldFootprints.push_back(footprint(scene.shapes[shapeIndex], camera));
       }
-      printMatrix(scene[0].getTransform());
 
-      for (int y = 0; y < height; y++) {
-	for (int x = 0; x < width; x++) {
-	  float ndcX = aspectRatio * ((2.0f * x) / width - 1.0f);
-	  float ndcY = 1.0f - (2.0f * y) / height;
-	  glm::vec4 clipCoords(ndcX, ndcY, -1.0f, 1.0f);
-	  glm::vec4 eyeCoords = glm::inverse(viewMatrix) * clipCoords;
-	  glm::vec3 rayDirection = -glm::normalize(glm::vec3(eyeCoords));
+      bool sceneChanged = false;
+      for (unsigned int key : keys) {
+	sceneChanged = applyKey(scene.shapes, key) || sceneChanged;
+      }
 
-	  glm::vec3 color = traceRay(globalCameraPosition, rayDirection, scene);
+      if (sceneChanged) {
+	scene.bvh.refit(scene.shapes);
+	printMatrix(scene.shapes[0].getTransform());
 
-	  image(x, y, 0, 0) = static_cast<unsigned char>(color.r * 255);
-	  image(x, y, 0, 1) = static_cast<unsigned char>(color.g * 255);
-	  image(x, y, 0, 2) = static_cast<unsigned char>(color.b * 255);
+	for (const ScreenRect& rect : oldFootprints) {
+	  dirtyRegion.mark(rect);
+	}
+	for (int shapeIndex : movedShapes) {
+	  dirtyRegion.mark(footprint(scene.shapes[shapeIndex], camera));
 	}
       }
-      
+      if (sceneChanged || framePending) {
+	startRegion(image, scene, camera, pool, dirtyRegion);
+	framePending = true;
+      }
+    }
+
+    if (framePending && pool.isDone()) {
       display.render(image);
       display.paint();
+      dirtyRegion.clear();
+      framePending = false;
     }
-    display.wait();
-    }
+    display.wait(10);
+  }
   
   return 0;
 }